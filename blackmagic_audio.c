@@ -0,0 +1,264 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include "blackmagic_audio.h"
+
+extern struct blackmagic_device *blackmagic_find_device_in_isr(void *ptr);
+
+/* Sequence count protocol for the shared status page, see blackmagic_ioctl.h */
+static inline void audio_status_begin(struct blackmagic_audio_status *status)
+{
+	status->seq++;
+	smp_wmb();
+}
+
+static inline void audio_status_end(struct blackmagic_audio_status *status)
+{
+	smp_wmb();
+	status->seq++;
+}
+
+static void audio_ring_release(struct kref *ref)
+{
+	struct blackmagic_audio_ring *ring = container_of(ref, struct blackmagic_audio_ring, ref);
+
+	free_page((unsigned long)ring->status);
+	kfree(ring);
+}
+
+static struct blackmagic_audio_ring *audio_ring_alloc(int direction)
+{
+	struct blackmagic_audio_ring *ring;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+
+	ring->status = (struct blackmagic_audio_status *)get_zeroed_page(GFP_KERNEL);
+	if (!ring->status)
+	{
+		kfree(ring);
+		return NULL;
+	}
+
+	kref_init(&ring->ref);
+	ring->direction = direction;
+	spin_lock_init(&ring->lock);
+	return ring;
+}
+
+static struct blackmagic_audio_ring *audio_ring_find(void *driver, int direction)
+{
+	struct blackmagic_device *ddev;
+
+	if (direction < 0 || direction >= BLACKMAGIC_AUDIO_DIRECTIONS)
+		return NULL;
+
+	ddev = blackmagic_find_device_in_isr(driver);
+	if (!ddev)
+		return NULL;
+
+	return ddev->audio[direction];
+}
+
+/*
+ * Called by the support library when audio starts, with the hardware sample
+ * buffer. Only its geometry is published; the buffer itself is not mapped.
+ */
+void blackmagic_audio_buffer_register(void *driver, int direction, void *buffer,
+	unsigned long size, unsigned int frame_bytes, unsigned int sample_rate)
+{
+	struct blackmagic_audio_ring *ring = audio_ring_find(driver, direction);
+	unsigned long flags;
+
+	if (!ring)
+		return;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	ring->registered = true;
+	ring->running = true;
+
+	audio_status_begin(ring->status);
+	ring->status->buffer_size = size;
+	ring->status->frame_bytes = frame_bytes;
+	ring->status->sample_rate = sample_rate;
+	ring->status->position = 0;
+	ring->status->wrap_count = 0;
+	ring->status->timestamp = dl_uptime();
+	audio_status_end(ring->status);
+	spin_unlock_irqrestore(&ring->lock, flags);
+}
+
+/* Called by the support library when audio stops, before the buffer is freed */
+void blackmagic_audio_buffer_unregister(void *driver, int direction)
+{
+	struct blackmagic_audio_ring *ring = audio_ring_find(driver, direction);
+	unsigned long flags;
+
+	if (!ring)
+		return;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	ring->running = false;
+
+	audio_status_begin(ring->status);
+	ring->status->buffer_size = 0;
+	audio_status_end(ring->status);
+	spin_unlock_irqrestore(&ring->lock, flags);
+}
+
+/* Called by the support library from its audio interrupt */
+void blackmagic_audio_position(void *driver, int direction, unsigned int position, unsigned int wrap_count)
+{
+	struct blackmagic_audio_ring *ring = audio_ring_find(driver, direction);
+	unsigned long flags;
+
+	if (!ring)
+		return;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	if (ring->running)
+	{
+		audio_status_begin(ring->status);
+		ring->status->position = position;
+		ring->status->wrap_count = wrap_count;
+		ring->status->timestamp = dl_uptime();
+		audio_status_end(ring->status);
+	}
+	spin_unlock_irqrestore(&ring->lock, flags);
+}
+
+static void audio_vm_open(struct vm_area_struct *vma)
+{
+	struct blackmagic_audio_ring *ring = vma->vm_private_data;
+
+	kref_get(&ring->ref);
+}
+
+static void audio_vm_close(struct vm_area_struct *vma)
+{
+	struct blackmagic_audio_ring *ring = vma->vm_private_data;
+
+	kref_put(&ring->ref, audio_ring_release);
+}
+
+static const struct vm_operations_struct audio_vm_ops = {
+	.open = audio_vm_open,
+	.close = audio_vm_close,
+};
+
+/*
+ * Map a status page. The page is the shim's own and the mapping holds a
+ * reference on it, so it outlives the device while mapped.
+ */
+int blackmagic_audio_mmap(struct blackmagic_device *ddev, struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+	struct blackmagic_audio_ring *ring;
+	int r;
+
+	switch (offset)
+	{
+		case BLACKMAGIC_MMAP_AUDIO_INPUT_STATUS:
+			ring = ddev->audio[BLACKMAGIC_AUDIO_INPUT];
+			break;
+
+		default:
+			return -EINVAL;
+	}
+
+	/*
+	 * Support library releases without the audio hooks never publish a
+	 * position, so don't offer a status page that would never change.
+	 */
+	if (!ring || !ACCESS_ONCE(ring->registered))
+		return -ENODEV;
+
+	/* Only the driver writes the status page */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+
+	r = remap_pfn_range(vma, vma->vm_start, __pa(ring->status) >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot);
+	if (r < 0)
+		return r;
+
+	vma->vm_private_data = ring;
+	vma->vm_ops = &audio_vm_ops;
+	kref_get(&ring->ref);
+	return 0;
+}
+
+int blackmagic_audio_init(struct blackmagic_device *ddev)
+{
+	int direction;
+
+	for (direction = 0; direction < BLACKMAGIC_AUDIO_DIRECTIONS; direction++)
+	{
+		ddev->audio[direction] = audio_ring_alloc(direction);
+		if (!ddev->audio[direction])
+		{
+			blackmagic_audio_remove(ddev);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+void blackmagic_audio_remove(struct blackmagic_device *ddev)
+{
+	struct blackmagic_audio_ring *ring;
+	unsigned long flags;
+	int direction;
+
+	for (direction = 0; direction < BLACKMAGIC_AUDIO_DIRECTIONS; direction++)
+	{
+		ring = ddev->audio[direction];
+		if (!ring)
+			continue;
+
+		spin_lock_irqsave(&ring->lock, flags);
+		ring->running = false;
+		audio_status_begin(ring->status);
+		ring->status->buffer_size = 0;
+		audio_status_end(ring->status);
+		spin_unlock_irqrestore(&ring->lock, flags);
+
+		ddev->audio[direction] = NULL;
+		kref_put(&ring->ref, audio_ring_release);
+	}
+}
@@ -0,0 +1,57 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+
+#ifndef BLACKMAGIC_AUDIO_H
+#define BLACKMAGIC_AUDIO_H
+
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include "blackmagic_core.h"
+
+/*
+ * Status page shared with userspace, carrying the hardware position in the
+ * audio buffer. The support library registers the buffer when audio starts
+ * and publishes the position from its audio interrupt. The samples stay
+ * with the library; only the page below is mapped.
+ */
+struct blackmagic_audio_ring
+{
+	struct kref ref;						/* Held by the device and each mapping */
+	int direction;							/* BLACKMAGIC_AUDIO_* */
+	spinlock_t lock;						/* Protects running and status updates */
+	bool registered;						/* The support library has published this ring */
+	bool running;							/* Between buffer register and unregister */
+	struct blackmagic_audio_status *status;	/* Shared page */
+};
+
+int blackmagic_audio_init(struct blackmagic_device *ddev);
+void blackmagic_audio_remove(struct blackmagic_device *ddev);
+int blackmagic_audio_mmap(struct blackmagic_device *ddev, struct file *filp, struct vm_area_struct *vma);
+
+#endif
@@ -0,0 +1,126 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include "blackmagic_batch.h"
+#include "blackmagic_gate.h"
+
+/*
+ * Support library commands that may be batched. They only dequeue or recycle
+ * completed frames and never sleep on the gate, which would drop the batch's
+ * hold, or wait for the interrupt bottom half while it is held.
+ */
+static const unsigned int blackmagic_batch_cmds[] =
+{
+	DL_CMD_GET_COMPLETED_PLAYBACK_FRAMES,
+	DL_CMD_GET_COMPLETED_INPUT_FRAME,
+	DL_CMD_RECYCLE_COMPLETED_INPUT_FRAMES,
+};
+
+static int blackmagic_batch_cmd_allowed(unsigned int cmd)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(blackmagic_batch_cmds); i++)
+		if (blackmagic_batch_cmds[i] == cmd)
+			return 1;
+	return 0;
+}
+
+/*
+ * BLACKMAGIC_IOC_BATCH: run a vector of support library commands under one
+ * hold of the device's command gate.
+ */
+long blackmagic_batch_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned long arg)
+{
+	struct blackmagic_batch __user *ubatch = (struct blackmagic_batch __user *)arg;
+	struct blackmagic_batch_entry *entries;
+	struct blackmagic_batch batch;
+	struct blackmagic_gate *gate = ddev->gate;
+	size_t size;
+	unsigned int i;
+	long r = 0;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > BLACKMAGIC_BATCH_MAX ||
+		(batch.flags & ~BLACKMAGIC_BATCH_STOP_ON_ERROR))
+		return -EINVAL;
+
+	size = batch.count * sizeof(*entries);
+	entries = kmalloc(size, GFP_KERNEL);
+	if (!entries)
+		return -ENOMEM;
+
+	if (copy_from_user(entries, (void __user *)(unsigned long)batch.entries, size))
+	{
+		r = -EFAULT;
+		goto out;
+	}
+
+	/* Only non-blocking support library commands */
+	for (i = 0; i < batch.count; i++)
+	{
+		if (!blackmagic_batch_cmd_allowed(entries[i].cmd))
+		{
+			r = -EPERM;
+			goto out;
+		}
+	}
+
+	if (gate)
+		dl_gate_hold(gate);
+
+	for (i = 0; i < batch.count; i++)
+	{
+		entries[i].result = blackmagic_ioctl_private(ddev->driver, filp->private_data,
+			entries[i].cmd, (unsigned long)entries[i].arg);
+		if (entries[i].result < 0 && (batch.flags & BLACKMAGIC_BATCH_STOP_ON_ERROR))
+		{
+			i++;
+			break;
+		}
+	}
+
+	if (gate)
+		dl_gate_release(gate);
+
+	batch.completed = i;
+	if (copy_to_user((void __user *)(unsigned long)batch.entries, entries, i * sizeof(*entries)) ||
+		put_user(batch.completed, &ubatch->completed))
+		r = -EFAULT;
+
+out:
+	kfree(entries);
+	return r;
+}
@@ -39,12 +39,52 @@
 #include <linux/poll.h>
 #include <linux/version.h>
 #include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/file.h>
+#include <linux/math64.h>
 
 #include "blackmagic_core.h"
+#include "blackmagic_ioctl.h"
+#include "blackmagic_audio.h"
+#include "blackmagic_batch.h"
+#include "blackmagic_deck.h"
+#include "blackmagic_fanout.h"
+#include "blackmagic_gate.h"
+#include "blackmagic_qos.h"
+#include "blackmagic_sink.h"
+#include "blackmagic_trace.h"
 
 unsigned long blackmagic_flags = 0;
 module_param(blackmagic_flags, ulong, S_IRUGO | S_IWUSR);
 
+/* Interrupt mode per card ID: "irq" (default), "poll" or "hybrid" */
+static char *blackmagic_irq_mode[BLACKMAGIC_MAX_DEVICES];
+static int blackmagic_irq_mode_count = 0;
+module_param_array(blackmagic_irq_mode, charp, &blackmagic_irq_mode_count, S_IRUGO);
+
+/* Poll thread period in poll mode, and interrupt watchdog period in hybrid mode */
+static unsigned int blackmagic_poll_period_us = 250;
+module_param(blackmagic_poll_period_us, uint, S_IRUGO);
+
+/* Upper bound on the busy-poll budget a BLACKMAGIC_IOC_WAIT caller may ask for */
+static unsigned int blackmagic_busy_poll_max_us = 50;
+module_param(blackmagic_busy_poll_max_us, uint, S_IRUGO | S_IWUSR);
+
+#ifndef MIN_NICE
+	#define MIN_NICE -20
+#endif
+
+static const char *blackmagic_irq_mode_names[] = {
+	[BLACKMAGIC_IRQ_MODE_IRQ]		= "irq",
+	[BLACKMAGIC_IRQ_MODE_POLL]		= "poll",
+	[BLACKMAGIC_IRQ_MODE_HYBRID]	= "hybrid",
+};
+
 static struct pci_device_id blackmagic_ids[] = {
 	{ PCI_DEVICE(0xbdbd, 0xa10b) },
 	{ PCI_DEVICE(0xbdbd, 0xa10c) },
@@ -81,18 +121,16 @@ extern int __init blackmagic_serial_init(void);
 extern int __init blackmagic_serial_exit(void);
 extern int blackmagic_serial_probe(struct blackmagic_device *, struct device *dev);
 extern void blackmagic_serial_remove(struct blackmagic_device *);
-
-#ifdef __i386__
-	// 32-bit systems may not have a 64-bit cmpxchg function, so limit the
-	// supported number of ids to 32.
-	typedef uint32_t device_mask_id_t;
-#else
-	typedef uint64_t device_mask_id_t;
-#endif
+extern long blackmagic_serial_ioctl(struct blackmagic_device *, struct file *, unsigned int cmd, unsigned long arg);
+extern void blackmagic_serial_claim(struct blackmagic_device *, struct file *);
+extern void blackmagic_serial_release(struct blackmagic_device *, struct file *);
+extern unsigned int blackmagic_serial_poll(struct blackmagic_device *, struct file *, poll_table *);
 
 static device_mask_id_t blackmagic_device_ids = 0;
 static LIST_HEAD(blackmagic_devices);
 static DEFINE_SPINLOCK(blackmagic_devices_lock);
+static DEFINE_PER_CPU(struct blackmagic_device *, blackmagic_isr_device);
+static struct proc_dir_entry *blackmagic_stats_entry = NULL;
 
 struct blackmagic_device *
 blackmagic_find_device_by_minor(int minor)
@@ -150,6 +188,59 @@ struct blackmagic_device *blackmagic_find_device_by_ptr(void *ptr)
 	return dev;
 }
 
+/*
+ * Callbacks made from within dl_interrupt_handler only get the driver handle.
+ * Use the device this CPU is servicing rather than walking the device list.
+ */
+struct blackmagic_device *blackmagic_find_device_in_isr(void *ptr)
+{
+	struct blackmagic_device *dev = __this_cpu_read(blackmagic_isr_device);
+
+	if (dev && dev->driver == ptr)
+		return dev;
+
+	return blackmagic_find_device_by_ptr(ptr);
+}
+
+/*
+ * To be called by the support library from its interrupt handler at the start
+ * of each video field, with the hardware field counter. Drives the deck
+ * engine's transmit timing and the field stamps on serial data.
+ *
+ * The shipped bmd-support.a does not call this yet, so field_clock stays at
+ * zero: the deck engine sends without waiting for a slot and serial stamps
+ * carry field 0. There is deliberately no timer standing in for it, as a
+ * timer has no phase relation to the video signal.
+ */
+void blackmagic_field_interrupt(void *driver, unsigned int field_count)
+{
+	struct blackmagic_device *ddev = blackmagic_find_device_in_isr(driver);
+
+	if (!ddev)
+		return;
+
+	blackmagic_field_clock_tick(&ddev->field_clock, field_count, dl_uptime());
+}
+
+/*
+ * Run the support library's interrupt handler and kick the tasklet. Called
+ * with isr_lock held and interrupts off, from the ISR or the poll thread.
+ */
+static unsigned int blackmagic_service_interrupt(struct blackmagic_device *ddev)
+{
+	unsigned int status;
+
+	__this_cpu_write(blackmagic_isr_device, ddev);
+	status = dl_interrupt_handler(ddev->driver);
+	__this_cpu_write(blackmagic_isr_device, NULL);
+	blackmagic_trace(BLACKMAGIC_TRACE_ISR, status, ddev->id);
+
+	if (status & DL_INTERRUPT_SCHED_TASKLET)
+		tasklet_schedule(&ddev->tasklet);
+
+	return status;
+}
+
 /*
  * Outer interrupt service routine.
  */
@@ -165,19 +256,112 @@ static irqreturn_t blackmagic_isr(int irq, void *dev)
 	if (!ddev)
 		return IRQ_NONE;
 	
-	status = dl_interrupt_handler(ddev->driver);
+	spin_lock(&ddev->isr_lock);
+		status = blackmagic_service_interrupt(ddev);
+		if (status & (DL_INTERRUPT_SCHED_TASKLET | DL_INTERRUPT_HANDLED))
+		{
+			ddev->irq_stats.irq_count++;
+			ddev->irq_stats.last_irq = dl_uptime();
+			dl_snapshot_publish(ddev->irq_snapshot, 0, &ddev->irq_stats, sizeof(ddev->irq_stats));
+		}
+	spin_unlock(&ddev->isr_lock);
 	
-	if (status & DL_INTERRUPT_SCHED_TASKLET)
-    {
-		tasklet_schedule(&ddev->tasklet);
-		return IRQ_HANDLED;
-	}
-	else if (status & DL_INTERRUPT_HANDLED)
+	if (status & (DL_INTERRUPT_SCHED_TASKLET | DL_INTERRUPT_HANDLED))
 		return IRQ_HANDLED;
 	
 	return IRQ_NONE;
 }
 
+/*
+ * Poll thread: runs the interrupt handler every blackmagic_poll_period_us in
+ * poll mode. In hybrid mode it only steps in once interrupts have been quiet
+ * for a period, and counts any work it finds as a lost interrupt.
+ */
+static int blackmagic_poll_thread(void *data)
+{
+	struct blackmagic_device *ddev = (struct blackmagic_device *)data;
+	unsigned long long period = blackmagic_poll_period_us * (unsigned long long)NSEC_PER_USEC;
+	unsigned long long last_irq;
+	unsigned long iflags;
+	unsigned int status;
+
+	set_user_nice(current, MIN_NICE);
+
+	while (!kthread_should_stop())
+	{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+		usleep_range(blackmagic_poll_period_us, blackmagic_poll_period_us + blackmagic_poll_period_us / 8 + 1);
+#else
+		msleep(1);
+#endif
+
+		if (ddev->irq_mode == BLACKMAGIC_IRQ_MODE_HYBRID)
+		{
+			dl_snapshot_read(ddev->irq_snapshot, offsetof(struct blackmagic_irq_stats, last_irq),
+				&last_irq, sizeof(last_irq));
+			if (dl_uptime() - last_irq < period)
+				continue;
+		}
+
+		spin_lock_irqsave(&ddev->isr_lock, iflags);
+			status = blackmagic_service_interrupt(ddev);
+			ddev->irq_stats.poll_count++;
+			if (ddev->irq_mode == BLACKMAGIC_IRQ_MODE_HYBRID && (status & (DL_INTERRUPT_SCHED_TASKLET | DL_INTERRUPT_HANDLED)))
+				ddev->irq_stats.lost_irq_count++;
+			dl_snapshot_publish(ddev->irq_snapshot, 0, &ddev->irq_stats, sizeof(ddev->irq_stats));
+		spin_unlock_irqrestore(&ddev->isr_lock, iflags);
+	}
+
+	return 0;
+}
+
+/*
+ * Wait until neither the ISR nor the poll thread is running the interrupt
+ * handler for this device.
+ */
+void blackmagic_synchronize_isr(struct blackmagic_device *ddev)
+{
+	unsigned long iflags;
+
+	if (ddev->irq_requested)
+		synchronize_irq(ddev->pdev->irq);
+
+	spin_lock_irqsave(&ddev->isr_lock, iflags);
+	spin_unlock_irqrestore(&ddev->isr_lock, iflags);
+}
+
+/*
+ * Replace the device's command gate if it is still old. The stats file reads
+ * the gate under the devices lock, so it never sees one being freed.
+ */
+void blackmagic_replace_device_gate(struct blackmagic_device *ddev, struct blackmagic_gate *old,
+	struct blackmagic_gate *gate)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&blackmagic_devices_lock, flags);
+	if (ddev->gate == old)
+		ddev->gate = gate;
+	spin_unlock_irqrestore(&blackmagic_devices_lock, flags);
+}
+
+static enum blackmagic_irq_modes blackmagic_parse_irq_mode(int id)
+{
+	enum blackmagic_irq_modes mode;
+
+	if (id < 0 || id >= blackmagic_irq_mode_count || !blackmagic_irq_mode[id])
+		return BLACKMAGIC_IRQ_MODE_IRQ;
+
+	for (mode = BLACKMAGIC_IRQ_MODE_IRQ; mode <= BLACKMAGIC_IRQ_MODE_HYBRID; mode++)
+	{
+		if (!strcmp(blackmagic_irq_mode[id], blackmagic_irq_mode_names[mode]))
+			return mode;
+	}
+
+	dl_info("Unknown interrupt mode \"%s\" for device %d, using interrupts\n", blackmagic_irq_mode[id], id);
+	return BLACKMAGIC_IRQ_MODE_IRQ;
+}
+
 /*
  * Main entry point for when an application/API opens a device.
  */
@@ -222,16 +406,297 @@ static int blackmagic_release(struct inode *inode, struct file *filp)
 	if (!ddev)
 		return -ENODEV;
 
-	/* try to close the serial port in case it was opened in IOCTL mode 
+	/* try to close the serial port in case this file opened it in IOCTL mode 
 	 * (does nothing if the serial port was closed or opened through TTY layer)
 	 */
-	blackmagic_serial_close_ioctl(ddev->driver);
+	blackmagic_serial_release(ddev, filp);
+	blackmagic_deck_release(ddev, filp);
+	blackmagic_sink_release(ddev, filp);
+	blackmagic_fanout_release(ddev, filp);
+	blackmagic_cpu_latency_release(ddev, filp);
+	dl_event_cursor_close(filp);
+	dl_event_unbind(filp->private_data);
+	dl_unpin_user_regions(filp, 0);
 
 	/* detach from the driver, and free the user client class */
 	dl_release_user_client(filp->private_data);
 	return 0;
 }
 
+/*
+ * Spin on the support library's completion state for up to budget_us.
+ * Gives up early if the CPU is wanted elsewhere.
+ */
+static unsigned int blackmagic_busy_poll(struct file *filp, unsigned int events, unsigned int budget_us)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 28)
+	/* dl_uptime() counts jiffies on these kernels */
+	unsigned long long end = dl_uptime() + usecs_to_jiffies(budget_us);
+#else
+	unsigned long long end = dl_uptime() + budget_us * (unsigned long long)NSEC_PER_USEC;
+#endif
+	unsigned int mask;
+
+	do
+	{
+		cpu_relax();
+		mask = dl_driver_do_poll(filp->private_data, filp, NULL) & events;
+	}
+	while (!mask && dl_uptime() < end && !need_resched() && !signal_pending(current));
+
+	return mask;
+}
+
+static long blackmagic_wait_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned long arg)
+{
+	struct blackmagic_wait __user *uwait = (struct blackmagic_wait __user *)arg;
+	struct blackmagic_wait wait;
+	struct poll_wqueues table;
+	poll_table *pt;
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	unsigned int budget;
+	unsigned int mask;
+	bool timed_out = false;
+	bool spun = false;
+	long ret = 0;
+
+	if (copy_from_user(&wait, uwait, sizeof(wait)))
+		return -EFAULT;
+
+	wait.events &= POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+	if (!wait.events)
+		return -EINVAL;
+
+	mask = dl_driver_do_poll(filp->private_data, filp, NULL) & wait.events;
+
+	budget = min(wait.busy_poll_us, blackmagic_busy_poll_max_us);
+	if (!mask && budget)
+	{
+		mask = blackmagic_busy_poll(filp, wait.events, budget);
+		if (mask)
+			atomic_long_inc(&ddev->busy_poll_hits);
+		else
+			spun = true;
+	}
+
+	if (!mask && wait.timeout_ms)
+	{
+		if (wait.timeout_ms != BLACKMAGIC_WAIT_FOREVER)
+			timeout = msecs_to_jiffies(wait.timeout_ms);
+
+		/* Register on the wait queues on the first pass only */
+		poll_initwait(&table);
+		pt = &table.pt;
+		for (;;)
+		{
+			mask = dl_driver_do_poll(filp->private_data, filp, pt) & wait.events;
+			pt = NULL;
+			if (mask || timed_out)
+				break;
+			if (signal_pending(current))
+			{
+				ret = -ERESTARTSYS;
+				break;
+			}
+
+			/* As poll_schedule_timeout, with a jiffies timeout */
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (!table.triggered)
+			{
+				/* Count a spin that ended in sleep once, when it sleeps */
+				if (spun)
+				{
+					atomic_long_inc(&ddev->busy_poll_sleeps);
+					spun = false;
+				}
+				timeout = schedule_timeout(timeout);
+			}
+			__set_current_state(TASK_RUNNING);
+			table.triggered = 0;
+			smp_mb();
+			if (!timeout)
+				timed_out = true;
+		}
+		poll_freewait(&table);
+
+		if (ret)
+			return ret;
+	}
+
+	if (!mask)
+		return -ETIMEDOUT;
+
+	if (put_user(mask, &uwait->revents))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long blackmagic_event_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct blackmagic_event_seq seq;
+	unsigned int seqs[2];
+	unsigned int events[2];
+	__u32 mode;
+	int ret;
+
+	switch (cmd)
+	{
+		case BLACKMAGIC_IOC_EVENT_MODE:
+			if (get_user(mode, (__u32 __user *)arg))
+				return -EFAULT;
+			if (mode & ~BLACKMAGIC_EVENT_EDGE)
+				return -EINVAL;
+			if (mode & BLACKMAGIC_EVENT_EDGE)
+				return dl_event_cursor_open(filp);
+			dl_event_cursor_close(filp);
+			return 0;
+
+		case BLACKMAGIC_IOC_EVENT_SEQ:
+			/* Poll once so the cursor holds the current sequence numbers */
+			dl_driver_do_poll(filp->private_data, filp, NULL);
+			ret = dl_event_cursor_read(filp, seqs, events);
+			if (ret < 0)
+				return ret;
+
+			seq.input_seq = seqs[0];
+			seq.output_seq = seqs[1];
+			seq.input_events = events[0];
+			seq.output_events = events[1];
+			if (copy_to_user((void __user *)arg, &seq, sizeof(seq)))
+				return -EFAULT;
+			return 0;
+	}
+
+	return -ENOTTY;
+}
+
+static long blackmagic_eventfd_ioctl(struct file *filp, unsigned long arg)
+{
+	struct blackmagic_eventfd_bind bind;
+	struct file *eventfd;
+	int ret;
+
+	if (copy_from_user(&bind, (void __user *)arg, sizeof(bind)))
+		return -EFAULT;
+
+	if (bind.fd < 0 || !bind.classes)
+	{
+		dl_event_unbind(filp->private_data);
+		return 0;
+	}
+
+	if (bind.classes & ~(BLACKMAGIC_EVENTFD_INPUT | BLACKMAGIC_EVENTFD_OUTPUT |
+			BLACKMAGIC_EVENTFD_AUDIO | BLACKMAGIC_EVENTFD_NOTIFICATION))
+		return -EINVAL;
+
+	/* Audio and notification queues are never attached, see dl_set_wait_queue_class */
+	if (bind.classes & (BLACKMAGIC_EVENTFD_AUDIO | BLACKMAGIC_EVENTFD_NOTIFICATION))
+		return -EOPNOTSUPP;
+
+	eventfd = fget(bind.fd);
+	if (!eventfd)
+		return -EBADF;
+
+	/* eventfd_ctx_fdget is GPL-only, so recognise the anon inode by name */
+	if (strcmp(eventfd->f_path.dentry->d_name.name, "[eventfd]") != 0)
+	{
+		fput(eventfd);
+		return -EINVAL;
+	}
+
+	ret = dl_event_bind(filp->private_data, eventfd, bind.classes);
+	if (ret < 0)
+	{
+		fput(eventfd);
+		return ret;
+	}
+
+	/* Poll once so the client's input and output queues are attached */
+	dl_driver_do_poll(filp->private_data, filp, NULL);
+	return 0;
+}
+
+static long blackmagic_pin_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned long arg)
+{
+	struct blackmagic_pin pin;
+	void *region;
+
+	if (copy_from_user(&pin, (void __user *)arg, sizeof(pin)))
+		return -EFAULT;
+
+	if (pin.flags & ~(BLACKMAGIC_PIN_WRITE | BLACKMAGIC_PIN_UNPIN))
+		return -EINVAL;
+
+	if (pin.flags & BLACKMAGIC_PIN_UNPIN)
+		return dl_unpin_user_regions(filp, (unsigned long)pin.addr) ? 0 : -ENOENT;
+
+	if (!pin.addr || !pin.len)
+		return -EINVAL;
+
+	if (!can_do_mlock())
+		return -EPERM;
+
+	region = dl_pin_user_region_cached(filp, (void *)(unsigned long)pin.addr, (unsigned long)pin.len,
+			pin.flags & BLACKMAGIC_PIN_WRITE, ddev->pdev);
+	if (IS_ERR(region))
+		return PTR_ERR(region);
+
+	return 0;
+}
+
+/*
+ * IOCTLs implemented in this driver rather than in the support library.
+ */
+static long
+blackmagic_ioctl_shim(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd)
+	{
+		case BLACKMAGIC_IOC_SERIAL_READ:
+		case BLACKMAGIC_IOC_SERIAL_WRITE:
+		case BLACKMAGIC_IOC_SERIAL_READ_STAMPED:
+			return blackmagic_serial_ioctl(ddev, filp, cmd, arg);
+
+		case BLACKMAGIC_IOC_WAIT:
+			return blackmagic_wait_ioctl(ddev, filp, arg);
+
+		case BLACKMAGIC_IOC_EVENT_MODE:
+		case BLACKMAGIC_IOC_EVENT_SEQ:
+			return blackmagic_event_ioctl(filp, cmd, arg);
+
+		case BLACKMAGIC_IOC_EVENTFD_BIND:
+			return blackmagic_eventfd_ioctl(filp, arg);
+
+		case BLACKMAGIC_IOC_BATCH:
+			return blackmagic_batch_ioctl(ddev, filp, arg);
+
+		case BLACKMAGIC_IOC_PIN:
+			return blackmagic_pin_ioctl(ddev, filp, arg);
+
+		case BLACKMAGIC_IOC_FANOUT_PUBLISHER:
+		case BLACKMAGIC_IOC_FANOUT_PUBLISH:
+		case BLACKMAGIC_IOC_FANOUT_RECLAIM:
+		case BLACKMAGIC_IOC_FANOUT_SUBSCRIBE:
+		case BLACKMAGIC_IOC_FANOUT_READ:
+		case BLACKMAGIC_IOC_FANOUT_RELEASE:
+			return blackmagic_fanout_ioctl(ddev, filp, cmd, arg);
+
+		case BLACKMAGIC_IOC_CAPTURE_SINK_START:
+		case BLACKMAGIC_IOC_CAPTURE_SINK_STOP:
+		case BLACKMAGIC_IOC_CAPTURE_SINK_COMPLETE:
+			return blackmagic_sink_ioctl(ddev, filp, cmd, arg);
+
+		case BLACKMAGIC_IOC_DECK_OPEN:
+		case BLACKMAGIC_IOC_DECK_CLOSE:
+		case BLACKMAGIC_IOC_DECK_SUBMIT:
+		case BLACKMAGIC_IOC_DECK_COMPLETE:
+			return blackmagic_deck_ioctl(ddev, filp, cmd, arg);
+	}
+
+	return -ENOTTY;
+}
+
 #ifdef HAVE_UNLOCKED_IOCTL
 static long
 blackmagic_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
@@ -242,6 +707,7 @@ blackmagic_ioctl(struct inode *inode, struct file *filp,
 #endif
 {
 	struct blackmagic_device *ddev;
+	long ret;
 #if HAVE_UNLOCKED_IOCTL
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
 	ddev = blackmagic_find_device_by_minor(iminor(file_inode(filp)));
@@ -257,22 +723,49 @@ blackmagic_ioctl(struct inode *inode, struct file *filp,
 	
 	if (!filp->private_data)
 		return -ENODEV;
+
+	if (_IOC_TYPE(cmd) == BLACKMAGIC_IOC_MAGIC)
+		return blackmagic_ioctl_shim(ddev, filp, cmd, arg);
 	
-	return blackmagic_ioctl_private(ddev->driver, filp->private_data, cmd, arg);
+	ret = blackmagic_ioctl_private(ddev->driver, filp->private_data, cmd, arg);
+	blackmagic_serial_claim(ddev, filp);
+	if (ret == 0)
+		blackmagic_cpu_latency_ioctl(ddev, filp, cmd);
+	return ret;
 }
 
 /*
  * Implements select/poll system call. POLLIN is used to signal to precense
- * of video input frames, and POLLOUT output.
+ * of video input frames, and POLLOUT output. POLLRDBAND and POLLWRBAND report
+ * the serial port when it is open in IOCTL mode, or deck completions. POLLPRI
+ * reports fan-out records, reclaimed frames and capture sink completions.
  */
 static unsigned int
 blackmagic_poll(struct file *filp, poll_table *wait)
 {
-	return dl_driver_do_poll(filp->private_data, filp, wait);
+	struct blackmagic_device *ddev;
+	unsigned int mask;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+	ddev = blackmagic_find_device_by_minor(iminor(file_inode(filp)));
+#else
+	ddev = blackmagic_find_device_by_minor(iminor(filp->f_dentry->d_inode));
+#endif
+
+	mask = dl_driver_do_poll(filp->private_data, filp, wait);
+	if (ddev)
+	{
+		mask |= blackmagic_serial_poll(ddev, filp, wait);
+		mask |= blackmagic_deck_poll(ddev, filp, wait);
+		mask |= blackmagic_fanout_poll(ddev, filp, wait);
+		mask |= blackmagic_sink_poll(ddev, filp, wait);
+	}
+
+	return mask;
 }
 
 static int blackmagic_mmap(struct file *filp, struct vm_area_struct *vma)
 {
+	struct blackmagic_device *ddev;
 	int r;
 	void* buffer;
 	unsigned long size;
@@ -280,6 +773,21 @@ static int blackmagic_mmap(struct file *filp, struct vm_area_struct *vma)
 	if (!filp->private_data)
 		return -ENODEV;
 
+	/* Shared audio rings and fan-out frames live above the support library's buffer types */
+	if (((unsigned long long)vma->vm_pgoff << PAGE_SHIFT) >= BLACKMAGIC_MMAP_AUDIO_INPUT_STATUS)
+	{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+		ddev = blackmagic_find_device_by_minor(iminor(file_inode(filp)));
+#else
+		ddev = blackmagic_find_device_by_minor(iminor(filp->f_dentry->d_inode));
+#endif
+		if (!ddev)
+			return -ENODEV;
+		if (((unsigned long long)vma->vm_pgoff << PAGE_SHIFT) >= BLACKMAGIC_MMAP_FANOUT_BASE)
+			return blackmagic_fanout_mmap(ddev, filp, vma);
+		return blackmagic_audio_mmap(ddev, filp, vma);
+	}
+
 	r = dl_mmap_buffer(filp->private_data, vma->vm_pgoff, &buffer, &size);
 	if (r < 0)
 		return r;
@@ -315,6 +823,7 @@ static void do_bh_work(void *data)
 	struct blackmagic_device *dev = (struct blackmagic_device*)data;
 #endif
 	dl_bh_work_handler(dev->driver);
+	blackmagic_trace(BLACKMAGIC_TRACE_WORK, 0, dev->id);
 	atomic_dec(&dev->workCount);
 }
 
@@ -324,6 +833,7 @@ static void blackmagic_tasklet_handler(unsigned long data)
 	struct blackmagic_device *dev = (struct blackmagic_device *)data;
 
 	status = dl_tasklet_handler(dev->driver);
+	blackmagic_trace(BLACKMAGIC_TRACE_TASKLET, status, dev->id);
 	if (status & DL_INTERRUPT_SCHED_WORK)
 	{
 		atomic_inc(&dev->workCount);
@@ -337,7 +847,7 @@ static int blackmagic_alloc_id(void)
 	device_mask_id_t mask;
 	device_mask_id_t old_id_map;
 
-	for (id = 0; id < sizeof(device_mask_id_t) * 8; /* nothing */)
+	for (id = 0; id < BLACKMAGIC_MAX_DEVICES; /* nothing */)
 	{
 		mask = (1UL << id);
 
@@ -395,6 +905,25 @@ blackmagic_create_device(struct pci_dev *pdev)
 	INIT_LIST_HEAD(&ddev->entry);
 	atomic_set(&ddev->ready, 0);
 	ddev->flags = 0;
+	blackmagic_field_clock_init(&ddev->field_clock);
+	ddev->irq_mode = blackmagic_parse_irq_mode(ddev->id);
+	atomic_long_set(&ddev->busy_poll_hits, 0);
+	atomic_long_set(&ddev->busy_poll_sleeps, 0);
+	blackmagic_cpu_latency_init(ddev);
+	spin_lock_init(&ddev->isr_lock);
+	ddev->irq_snapshot = dl_alloc_snapshot(sizeof(struct blackmagic_irq_stats));
+	if (!ddev->irq_snapshot)
+		goto fail;
+	spin_lock_init(&ddev->serial_lock);
+	init_waitqueue_head(&ddev->serial_rx_wait);
+	init_waitqueue_head(&ddev->serial_tx_wait);
+	mutex_init(&ddev->deck_mutex);
+	init_waitqueue_head(&ddev->deck_wait);
+	init_waitqueue_head(&ddev->sink_wait);
+	if (blackmagic_audio_init(ddev) < 0)
+		goto fail;
+	if (blackmagic_fanout_init(ddev) < 0)
+		goto fail;
 	ddev->mdev.minor = MISC_DYNAMIC_MINOR;
 	ddev->mdev.name = name;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
@@ -425,6 +954,10 @@ blackmagic_create_device(struct pci_dev *pdev)
 	return ddev;
 
 fail:
+	blackmagic_fanout_remove(ddev);
+	blackmagic_audio_remove(ddev);
+	if (ddev->irq_snapshot)
+		dl_free_snapshot(ddev->irq_snapshot);
 	if (name)
 		kfree(name);
 	if (ddev->pdev)
@@ -449,6 +982,10 @@ blackmagic_destroy_device(struct blackmagic_device *ddev)
 	spin_lock(&blackmagic_devices_lock);
 	list_del(&ddev->entry);
 	spin_unlock(&blackmagic_devices_lock);
+
+	blackmagic_fanout_remove(ddev);
+	blackmagic_audio_remove(ddev);
+	dl_free_snapshot(ddev->irq_snapshot);
 	
 	if (ddev->mdev.name)
 		kfree(ddev->mdev.name);
@@ -511,17 +1048,34 @@ bool dl_pci_register_interrupt(void* pci_dev, int source)
 	struct blackmagic_device* ddev = (struct blackmagic_device*)pci_get_drvdata(pdev);
 	unsigned long flags = 0;
 
-	if (source == 1)
-		pci_enable_msi(pdev);
+	if (ddev->irq_mode != BLACKMAGIC_IRQ_MODE_POLL)
+	{
+		if (source == 1)
+			pci_enable_msi(pdev);
+
+		if (!pdev->msi_enabled)
+			flags |= IRQF_SHARED;
 
-	if (!pdev->msi_enabled)
-		flags |= IRQF_SHARED;
+		if (request_irq(pdev->irq, blackmagic_isr, flags, ddev->mdev.name, ddev) < 0)
+		{
+			if (pdev->msi_enabled)
+				pci_disable_msi(pdev);
+			return false;
+		}
+		ddev->irq_requested = true;
+	}
 
-	if (request_irq(pdev->irq, blackmagic_isr, flags, ddev->mdev.name, ddev) < 0)
+	if (ddev->irq_mode != BLACKMAGIC_IRQ_MODE_IRQ)
 	{
-		if (pdev->msi_enabled)
-			pci_disable_msi(pdev);
-		return false;
+		ddev->poll_thread = kthread_run(blackmagic_poll_thread, ddev, "bmd-poll/%d", ddev->id);
+		if (IS_ERR(ddev->poll_thread))
+		{
+			ddev->poll_thread = NULL;
+			dl_pci_unregister_interrupt(pci_dev);
+			return false;
+		}
+		dl_info("Device %d using %s interrupt mode, %u us period\n", ddev->id,
+			blackmagic_irq_mode_names[ddev->irq_mode], blackmagic_poll_period_us);
 	}
 
 	return true;
@@ -532,7 +1086,17 @@ void dl_pci_unregister_interrupt(void* pci_dev)
 	struct pci_dev* pdev = (struct pci_dev*)pci_dev;
 	struct blackmagic_device* ddev = (struct blackmagic_device*)pci_get_drvdata(pdev);
 
+	if (ddev->poll_thread)
+	{
+		kthread_stop(ddev->poll_thread);
+		ddev->poll_thread = NULL;
+	}
+
+	if (!ddev->irq_requested)
+		return;
+
 	free_irq(pdev->irq, ddev);
+	ddev->irq_requested = false;
 
 	if (pdev->msi_enabled)
 		pci_disable_msi(pdev);
@@ -628,6 +1192,10 @@ static void blackmagic_remove(struct pci_dev *pdev)
 		PCI_SLOT(pdev->devfn),
 		PCI_FUNC(pdev->devfn));
 
+	blackmagic_deck_remove(ddev);
+	blackmagic_sink_remove(ddev);
+	blackmagic_cpu_latency_remove(ddev);
+
 	if (ddev->flags & BLACKMAGIC_DEV_HAS_SERIAL)
 		blackmagic_serial_remove(ddev);
 
@@ -647,15 +1215,125 @@ static struct pci_driver pci_driver = {
 
 
 
+static const char *blackmagic_event_class_names[] = {
+	[DL_EVENT_CLASS_NONE] = "none",
+	[DL_EVENT_CLASS_INPUT] = "input",
+	[DL_EVENT_CLASS_OUTPUT] = "output",
+	[DL_EVENT_CLASS_AUDIO] = "audio",
+	[DL_EVENT_CLASS_NOTIFICATION] = "notification",
+};
+
+struct blackmagic_stats_queue_walk
+{
+	struct seq_file *m;
+	unsigned int index;
+};
+
+static void blackmagic_stats_show_queue(void *arg, const struct dl_wait_queue_stats *wq)
+{
+	struct blackmagic_stats_queue_walk *walk = (struct blackmagic_stats_queue_walk *)arg;
+	unsigned int event_class = wq->event_class;
+
+	seq_printf(walk->m, "wait_queue %u\n", walk->index++);
+	seq_printf(walk->m, "  class: %s\n", event_class < ARRAY_SIZE(blackmagic_event_class_names) ?
+		blackmagic_event_class_names[event_class] : "unknown");
+	seq_printf(walk->m, "  wakeups: %lu\n", wq->wakeups);
+	seq_printf(walk->m, "  wakeups_skipped: %lu\n", wq->skipped);
+}
+
+/*
+ * /proc/driver/blackmagic/stats: wait queue and per device counters.
+ */
+static int blackmagic_stats_show(struct seq_file *m, void *v)
+{
+	struct blackmagic_device *ddev;
+	struct dl_wait_queue_stats wq;
+	struct blackmagic_gate_stats gs;
+	struct blackmagic_irq_stats is;
+	struct blackmagic_stats_queue_walk walk = { m, 0 };
+	unsigned long flags;
+
+	dl_get_wait_queue_stats(NULL, &wq);
+	seq_printf(m, "wait_queues\n");
+	seq_printf(m, "  wakeups: %lu\n", wq.wakeups);
+	seq_printf(m, "  wakeups_skipped: %lu\n", wq.skipped);
+	dl_walk_wait_queue_stats(blackmagic_stats_show_queue, &walk);
+
+	spin_lock_irqsave(&blackmagic_devices_lock, flags);
+
+	list_for_each_entry(ddev, &blackmagic_devices, entry)
+	{
+		seq_printf(m, "device %d\n", ddev->id);
+		seq_printf(m, "  irq_mode: %s\n", blackmagic_irq_mode_names[ddev->irq_mode]);
+		dl_snapshot_read(ddev->irq_snapshot, 0, &is, sizeof(is));
+		seq_printf(m, "  interrupts: %lu\n", is.irq_count);
+		seq_printf(m, "  polls: %lu\n", is.poll_count);
+		seq_printf(m, "  lost_interrupts: %lu\n", is.lost_irq_count);
+		seq_printf(m, "  busy_poll_hits: %ld\n", atomic_long_read(&ddev->busy_poll_hits));
+		seq_printf(m, "  busy_poll_sleeps: %ld\n", atomic_long_read(&ddev->busy_poll_sleeps));
+		seq_printf(m, "  cpu_latency_us: %d\n", ddev->cpu_latency.target_us);
+		seq_printf(m, "  cpu_latency_active: %d\n", atomic_read(&ddev->cpu_latency.state) == CPU_LATENCY_ACTIVE);
+		seq_printf(m, "  cpu_latency_requests: %lu\n", ddev->cpu_latency.requests);
+		if (ddev->gate)
+		{
+			dl_gate_get_stats(ddev->gate, &gs);
+			seq_printf(m, "  gate_holds: %lu\n", gs.holds);
+			seq_printf(m, "  gate_hold_avg_ns: %llu\n", gs.holds ? div64_u64(gs.hold_time, gs.holds) : 0ULL);
+			seq_printf(m, "  gate_hold_max_ns: %llu\n", gs.max_hold);
+		}
+	}
+
+	spin_unlock_irqrestore(&blackmagic_devices_lock, flags);
+
+	return 0;
+}
+
+static int blackmagic_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, blackmagic_stats_show, NULL);
+}
+
+static struct file_operations blackmagic_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = blackmagic_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void blackmagic_stats_exit(void)
+{
+	if (blackmagic_stats_entry)
+	{
+		remove_proc_entry("stats", blackmagic_proc_dir);
+		blackmagic_stats_entry = NULL;
+	}
+}
+
 static int __init pci_blackmagic_init(void)
 {
 	int ret;
 
 	blackmagic_lib_init();
+
+	ret = blackmagic_trace_init();
+	if (ret)
+		return ret;
+
+	blackmagic_stats_entry = proc_create("stats", S_IRUGO, blackmagic_proc_dir, &blackmagic_stats_fops);
+	if (!blackmagic_stats_entry)
+	{
+		blackmagic_trace_exit();
+		return -ENOMEM;
+	}
     
 	ret = blackmagic_serial_init();
 	if (ret)
+	{
+		blackmagic_stats_exit();
+		blackmagic_trace_exit();
 		return ret;
+	}
     
     dl_info("Loading driver (version: 10.5.2a5)\n");
 	return pci_register_driver(&pci_driver);
@@ -665,7 +1343,10 @@ static void __exit pci_blackmagic_exit(void)
 {
 	pci_unregister_driver(&pci_driver);
 	dl_destroy_wait_queue_cache();
+	dl_pinned_regions_exit();
 	blackmagic_serial_exit();
+	blackmagic_stats_exit();
+	blackmagic_trace_exit();
 	blackmagic_lib_destroy();
 }
 
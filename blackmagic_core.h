@@ -40,43 +40,160 @@
 #include <linux/list.h>
 #include <linux/wait.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/version.h>
 #include <linux/tty.h>
+#include <linux/kfifo.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 
 #include "blackmagic_lib.h"
+#include "blackmagic_ioctl.h"
 #include "blackmagic_iml.h"
 
-#define BLACKMAGIC_SERIAL_MINORS	32
+#ifdef __i386__
+	// 32-bit systems may not have a 64-bit cmpxchg function, so limit the
+	// supported number of ids to 32.
+	typedef uint32_t device_mask_id_t;
+#else
+	typedef uint64_t device_mask_id_t;
+#endif
+
+#define BLACKMAGIC_MAX_DEVICES		(sizeof(device_mask_id_t) * 8)
+#define BLACKMAGIC_SERIAL_MINORS	BLACKMAGIC_MAX_DEVICES	/* One port per card ID */
 #define BLACKMAGIC_HW_TX_SIZE		16
-#define BLACKMAGIC_SERIAL_BUFFER_SIZE	PAGE_SIZE
+#define BLACKMAGIC_HW_RX_SIZE		64	/* Bytes drained from the RX FIFO per batch */
+#define BLACKMAGIC_SERIAL_RX_STAMPS	256	/* Stamped RX batches held at once */
 
 enum blackmagic_serial_open_states {
 	PORT_CLOSED = 0,
 	PORT_OPEN_IOCTL,
 	PORT_OPEN_TTY,
+	PORT_OPEN_DECK,
 };
 
-struct blackmagic_serial_buffer
+/* One RX interrupt's worth of bytes in the read ring */
+struct blackmagic_serial_rx_batch
 {
-	unsigned char data[BLACKMAGIC_SERIAL_BUFFER_SIZE];
-	unsigned char *end;
-	unsigned char *next;
-	unsigned char *last;
-	unsigned int available_bytes;
+	struct blackmagic_serial_stamp stamp;
+	unsigned int bytes;
 };
 
+struct blackmagic_device;
+
 struct blackmagic_serial 
 {
+	struct blackmagic_device *ddev;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 8, 0)
 	struct tty_struct *tty;
 #else
 	struct tty_port port;
 #endif
 	enum blackmagic_serial_open_states open_state;
-	atomic_t tx_interrupt_pending;
-	spinlock_t lock;
-	struct blackmagic_serial_buffer write_buffer;	/* Circular write buffer */
-	struct blackmagic_serial_buffer read_buffer;	/* Circular read buffer - used only when opened in IOCTL mode*/
+	struct task_struct *opener;				/* Opened in IOCTL mode, until the ioctl returns */
+	struct file *owner;						/* File that opened the port in IOCTL mode */
+	atomic_t tx_interrupt_pending;			/* HW transmitting, or being loaded by setup_tx */
+	spinlock_t lock;						/* Protects open_state, opener and owner */
+	spinlock_t write_lock;					/* Serialises writers of write_fifo */
+	spinlock_t read_lock;					/* Serialises readers of read_fifo */
+	struct kfifo write_fifo;				/* Write ring: enqueue_data -> setup_tx */
+	struct kfifo read_fifo;					/* Read ring: RX interrupt -> dequeue_data or rx_work */
+	DECLARE_KFIFO(rx_batches, struct blackmagic_serial_rx_batch, BLACKMAGIC_SERIAL_RX_STAMPS);
+	unsigned int rx_batch_used;				/* Bytes already read from the oldest batch */
+	atomic_t rx_overflow;					/* Received bytes dropped on a full read ring */
+	atomic_t tx_overflow;					/* Bytes refused by a full write ring */
+	struct work_struct rx_work;				/* Pushes the read ring to the TTY layer */
+	atomic_t rx_work_count;
+	atomic_t users;							/* Clients inside the serial ioctls and poll */
+	bool gone;								/* Being removed; under ddev->serial_lock */
+};
+
+/*
+ * Start of the most recent video field and the estimated field period, both
+ * in dl_uptime() ns. Written from interrupt context, read with the seqlock.
+ */
+struct blackmagic_field_clock
+{
+	seqlock_t lock;
+	unsigned long long time;
+	unsigned long long period;
+	unsigned int count;						/* Hardware field counter */
+};
+
+static inline void blackmagic_field_clock_init(struct blackmagic_field_clock *clock)
+{
+	seqlock_init(&clock->lock);
+	clock->time = 0;
+	clock->period = 0;
+	clock->count = 0;
+}
+
+static inline void blackmagic_field_clock_tick(struct blackmagic_field_clock *clock, unsigned int count, unsigned long long now)
+{
+	unsigned long flags;
+
+	write_seqlock_irqsave(&clock->lock, flags);
+		/* Ignore gaps (signal loss, mode change) when estimating the period */
+		if (clock->time && now > clock->time && now - clock->time < NSEC_PER_SEC / 10)
+			clock->period = now - clock->time;
+		clock->time = now;
+		clock->count = count;
+	write_sequnlock_irqrestore(&clock->lock, flags);
+}
+
+static inline unsigned int blackmagic_field_clock_read(struct blackmagic_field_clock *clock, unsigned long long *time, unsigned long long *period)
+{
+	unsigned int seq;
+	unsigned int count;
+
+	do {
+		seq = read_seqbegin(&clock->lock);
+		count = clock->count;
+		if (time)
+			*time = clock->time;
+		if (period)
+			*period = clock->period;
+	} while (read_seqretry(&clock->lock, seq));
+
+	return count;
+}
+
+/* See blackmagic_qos.h */
+struct blackmagic_cpu_latency
+{
+	int target_us;							/* -1 when disabled */
+	atomic_t state;
+	spinlock_t lock;						/* Protects clients and streams */
+	struct list_head clients;				/* Files with streams enabled */
+	unsigned int streams;					/* Enabled streams across those files */
+	struct file *file;						/* /dev/cpu_dma_latency, while requested */
+	unsigned long requests;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+	struct delayed_work work;
+#else
+	struct work_struct work;
+#endif
+};
+
+struct blackmagic_deck;
+struct blackmagic_audio_ring;
+struct blackmagic_gate;
+struct blackmagic_fanout;
+struct blackmagic_sink;
+
+/* Interrupt handler counters, published to a dl_snapshot_t after each update */
+struct blackmagic_irq_stats
+{
+	unsigned long long last_irq;		/* dl_uptime() of the last interrupt that found work */
+	unsigned long irq_count;			/* Interrupts that found work */
+	unsigned long poll_count;			/* Handler runs from the poll thread */
+	unsigned long lost_irq_count;		/* Hybrid: poll runs that found work the interrupt missed */
+};
+
+enum blackmagic_irq_modes {
+	BLACKMAGIC_IRQ_MODE_IRQ = 0,		/* Hardware interrupts only */
+	BLACKMAGIC_IRQ_MODE_POLL,			/* No interrupt, the poll thread runs the handler */
+	BLACKMAGIC_IRQ_MODE_HYBRID,			/* Interrupts, with the poll thread as a watchdog */
 };
 
 struct blackmagic_device
@@ -87,11 +204,32 @@ struct blackmagic_device
 	struct tasklet_struct tasklet;		/* tasklet (critical bh) */
 	struct work_struct work;			/* work handler (non-critical bh) */
 	struct list_head entry;
-	struct blackmagic_serial sdev;		/* Serial driver device */
+	struct blackmagic_serial *sdev;		/* Serial driver device, only with BLACKMAGIC_DEV_HAS_SERIAL */
+	spinlock_t serial_lock;				/* Publishes sdev and takes sdev->users */
+	wait_queue_head_t serial_rx_wait;	/* Serial readers in IOCTL mode, and remove; outlives sdev */
+	wait_queue_head_t serial_tx_wait;	/* Serial writers in IOCTL mode; outlives sdev */
 	unsigned int flags;					/* Device Capablities */
 	int id;                             /* Card ID */
 	atomic_t ready;						/* Card state */
 	atomic_t workCount;
+	struct blackmagic_field_clock field_clock;	/* Fed by blackmagic_field_interrupt, once the library calls it */
+	struct mutex deck_mutex;			/* Serialises deck open, close, submit and the users of deck */
+	struct blackmagic_deck *deck;		/* 9-pin deck engine, while open */
+	wait_queue_head_t deck_wait;		/* Deck completions and close; outlives the deck */
+	enum blackmagic_irq_modes irq_mode;
+	bool irq_requested;
+	spinlock_t isr_lock;				/* Serialises the ISR and the poll thread */
+	struct task_struct *poll_thread;
+	struct blackmagic_irq_stats irq_stats;	/* Under isr_lock */
+	struct dl_snapshot_t *irq_snapshot;	/* irq_stats for the poll thread and the stats file */
+	atomic_long_t busy_poll_hits;		/* BLACKMAGIC_IOC_WAIT satisfied while spinning */
+	atomic_long_t busy_poll_sleeps;		/* BLACKMAGIC_IOC_WAIT that spun, then had to sleep */
+	struct blackmagic_cpu_latency cpu_latency;
+	struct blackmagic_audio_ring *audio[BLACKMAGIC_AUDIO_DIRECTIONS];	/* Shared audio rings */
+	struct blackmagic_gate *gate;		/* Command gate, set by dl_gate_set_device */
+	struct blackmagic_fanout *fanout;	/* Capture fan-out to subscribed clients */
+	struct blackmagic_sink *sink;		/* Capture-to-file sink, while started */
+	wait_queue_head_t sink_wait;		/* Sink completions and stop; outlives the sink */
 };
 
 #endif
@@ -0,0 +1,616 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+#include "blackmagic_deck.h"
+
+extern void blackmagic_synchronize_isr(struct blackmagic_device *);
+extern int blackmagic_serial_open_deck(struct blackmagic_device *);
+extern int blackmagic_serial_close_deck(struct blackmagic_device *);
+extern int blackmagic_serial_read_batch(struct blackmagic_serial *, unsigned char *, int, struct blackmagic_serial_stamp *);
+
+#ifndef MIN_NICE
+	#define MIN_NICE -20
+#endif
+
+/* Decks are expected to answer within one field */
+#define DECK_DEFAULT_TIMEOUT_MS		20
+#define DECK_MAX_OFFSET_US			100000
+/* Field rate of the simulated deck, 59.94 Hz */
+#define DECK_LOOPBACK_PERIOD		16683350ULL
+
+static inline unsigned char deck_checksum(const unsigned char *msg, unsigned int len)
+{
+	unsigned char sum = 0;
+
+	while (len--)
+		sum += *msg++;
+
+	return sum;
+}
+
+/* CMD1 carries the number of data bytes in its low nibble */
+static inline unsigned int deck_msg_length(unsigned char cmd1)
+{
+	return 2 + (cmd1 & 0x0f);
+}
+
+static void deck_sleep_us(unsigned long us)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	usleep_range(us, us + 50);
+#else
+	if (us >= 1000)
+		msleep(us / 1000);
+	udelay(us % 1000);
+#endif
+}
+
+static long deck_jiffies(unsigned long long ns)
+{
+	return usecs_to_jiffies(div_u64(ns, NSEC_PER_USEC)) + 1;
+}
+
+static inline unsigned char to_bcd(unsigned int v)
+{
+	return ((v / 10) << 4) | (v % 10);
+}
+
+/*
+ * Simulated deck answering the common commands, used to exercise the engine
+ * without a deck attached. Timecode runs from the simulated field clock.
+ */
+static void deck_loopback_respond(struct blackmagic_deck *deck, const unsigned char *msg, unsigned int len)
+{
+	unsigned char reply[BLACKMAGIC_DECK_MAX_MSG + 1];
+	unsigned int frames;
+	unsigned int n = 0;
+	unsigned int i;
+
+	if (deck_checksum(msg, len - 1) != msg[len - 1])
+	{
+		/* NAK, checksum error */
+		reply[n++] = 0x11;
+		reply[n++] = 0x12;
+		reply[n++] = 0x04;
+	}
+	else if (msg[0] == 0x00 && msg[1] == 0x11)
+	{
+		/* Device type */
+		reply[n++] = 0x12;
+		reply[n++] = 0x11;
+		reply[n++] = 0x20;
+		reply[n++] = 0x25;
+	}
+	else if (msg[0] == 0x61 && msg[1] == 0x0c)
+	{
+		/* Current time sense, 30 fps non-drop */
+		frames = deck->loop_clock.count / 2;
+		reply[n++] = 0x74;
+		reply[n++] = 0x04;
+		reply[n++] = to_bcd(frames % 30);
+		reply[n++] = to_bcd((frames / 30) % 60);
+		reply[n++] = to_bcd((frames / 1800) % 60);
+		reply[n++] = to_bcd((frames / 108000) % 24);
+	}
+	else if (msg[0] == 0x61 && msg[1] == 0x20 && len > 3)
+	{
+		/* Status sense, all bits clear */
+		reply[n++] = 0x70 | (msg[2] & 0x0f);
+		reply[n++] = 0x20;
+		for (i = 0; i < (msg[2] & 0x0f); i++)
+			reply[n++] = 0;
+	}
+	else
+	{
+		/* ACK */
+		reply[n++] = 0x10;
+		reply[n++] = 0x01;
+	}
+
+	reply[n] = deck_checksum(reply, n);
+	n++;
+
+	deck->rx_time = dl_uptime();
+	deck->rx_field = deck->loop_clock.count;
+	kfifo_in(&deck->loop_fifo, reply, n);
+}
+
+static void deck_loopback_tick(struct blackmagic_deck *deck)
+{
+	unsigned long long now = dl_uptime();
+
+	if (now < deck->loop_next_field)
+		return;
+
+	/* Stamp the scheduled time, not the wakeup time, so the clock is exact */
+	blackmagic_field_clock_tick(&deck->loop_clock, deck->loop_clock.count + 1, deck->loop_next_field);
+	deck->loop_next_field += DECK_LOOPBACK_PERIOD;
+	if (deck->loop_next_field <= now)
+		deck->loop_next_field = now + DECK_LOOPBACK_PERIOD;
+}
+
+static void deck_complete(struct blackmagic_deck *deck, int status)
+{
+	struct blackmagic_deck_completion *c = &deck->current_cmd;
+
+	c->status = status;
+
+	spin_lock(&deck->lock);
+		/* Keep the newest completions if nobody is collecting them */
+		if (kfifo_is_full(&deck->done))
+		{
+			kfifo_skip(&deck->done);
+			atomic_inc(&deck->done_overflow);
+		}
+		kfifo_in(&deck->done, c, 1);
+	spin_unlock(&deck->lock);
+
+	deck->busy = false;
+	deck->rx_len = 0;
+	wake_up_interruptible(&deck->ddev->deck_wait);
+}
+
+static void deck_receive_byte(struct blackmagic_deck *deck, unsigned char byte)
+{
+	struct blackmagic_deck_completion *c = &deck->current_cmd;
+	unsigned int len;
+
+	/* Nothing outstanding, drop unsolicited bytes */
+	if (!deck->busy)
+		return;
+
+	/* Stamp the response with the batch its first byte arrived in */
+	if (deck->rx_len == 0)
+	{
+		deck->rx_msg_time = deck->rx_time;
+		deck->rx_msg_field = deck->rx_field;
+	}
+
+	deck->rx_msg[deck->rx_len++] = byte;
+	len = deck_msg_length(deck->rx_msg[0]);
+	if (deck->rx_len <= len)
+		return;
+
+	c->length = len;
+	memcpy(c->data, deck->rx_msg, len);
+	c->response_time = deck->rx_msg_time;
+	c->response_field = deck->rx_msg_field;
+	deck_complete(deck, deck_checksum(deck->rx_msg, len) == deck->rx_msg[len] ? 0 : -EIO);
+}
+
+static void deck_receive(struct blackmagic_deck *deck)
+{
+	struct blackmagic_serial_stamp stamp;
+	unsigned char buf[BLACKMAGIC_HW_RX_SIZE];
+	unsigned int len;
+	unsigned int i;
+
+	for (;;)
+	{
+		if (deck->loopback)
+			len = kfifo_out(&deck->loop_fifo, buf, sizeof(buf));
+		else
+		{
+			len = blackmagic_serial_read_batch(deck->ddev->sdev, buf, sizeof(buf), &stamp);
+			deck->rx_time = stamp.timestamp;
+			deck->rx_field = stamp.field;
+		}
+		if (!len)
+			break;
+
+		for (i = 0; i < len; i++)
+			deck_receive_byte(deck, buf[i]);
+	}
+}
+
+/*
+ * Sleep until the configured offset into the current or next field. If the
+ * field clock isn't running, send straight away rather than stall the queue.
+ */
+static void deck_wait_for_slot(struct blackmagic_deck *deck)
+{
+	unsigned long long field_time;
+	unsigned long long period;
+	unsigned long long target;
+	unsigned long long now;
+
+	blackmagic_field_clock_read(deck->clock, &field_time, &period);
+
+	now = dl_uptime();
+	if (!period || now < field_time || now - field_time > 2 * period)
+		return;
+
+	target = field_time + deck->offset;
+	if (target < now)
+		target += period * (div64_u64(now - target, period) + 1);
+
+	deck_sleep_us(div_u64(target - now, NSEC_PER_USEC));
+}
+
+static void deck_transmit(struct blackmagic_deck *deck, const struct blackmagic_deck_command *cmd)
+{
+	struct blackmagic_deck_completion *c = &deck->current_cmd;
+	unsigned char msg[BLACKMAGIC_DECK_MAX_MSG + 1];
+	unsigned int len = cmd->length;
+
+	memcpy(msg, cmd->data, len);
+	msg[len] = deck_checksum(msg, len);
+	len++;
+
+	memset(c, 0, sizeof(*c));
+	c->tag = cmd->tag;
+	c->sent_field = blackmagic_field_clock_read(deck->clock, NULL, NULL);
+	c->sent_time = dl_uptime();
+
+	deck->busy = true;
+	deck->rx_len = 0;
+	deck->deadline = c->sent_time + deck->timeout;
+
+	if (deck->loopback)
+		deck_loopback_respond(deck, msg, len);
+	else if (blackmagic_serial_enqueue_data(deck->ddev->driver, msg, len) != len)
+		deck_complete(deck, -EIO);
+}
+
+static bool deck_has_work(struct blackmagic_deck *deck)
+{
+	if (!deck->busy && !kfifo_is_empty(&deck->queue))
+		return true;
+
+	if (deck->loopback)
+		return !kfifo_is_empty(&deck->loop_fifo);
+
+	return !kfifo_is_empty(&deck->ddev->sdev->read_fifo);
+}
+
+static long deck_idle_timeout(struct blackmagic_deck *deck)
+{
+	unsigned long long now = dl_uptime();
+	unsigned long long next = 0;
+
+	if (deck->busy)
+		next = deck->deadline;
+	if (deck->loopback && (!next || deck->loop_next_field < next))
+		next = deck->loop_next_field;
+
+	if (!next)
+		return MAX_SCHEDULE_TIMEOUT;
+
+	return next > now ? deck_jiffies(next - now) : 0;
+}
+
+static int blackmagic_deck_thread(void *data)
+{
+	struct blackmagic_deck *deck = data;
+	struct blackmagic_deck_command cmd;
+
+	set_user_nice(current, MIN_NICE);
+
+	while (!kthread_should_stop())
+	{
+		if (deck->loopback)
+			deck_loopback_tick(deck);
+
+		deck_receive(deck);
+
+		if (deck->busy && dl_uptime() >= deck->deadline)
+			deck_complete(deck, -ETIMEDOUT);
+
+		if (!deck->busy && kfifo_out_spinlocked(&deck->queue, &cmd, 1, &deck->lock))
+		{
+			deck_wait_for_slot(deck);
+			deck_transmit(deck, &cmd);
+			continue;
+		}
+
+		wait_event_interruptible_timeout(deck->wait,
+			kthread_should_stop() || deck_has_work(deck), deck_idle_timeout(deck));
+	}
+
+	/* Fail whatever is left so clients aren't left waiting */
+	if (deck->busy)
+		deck_complete(deck, -ECANCELED);
+
+	while (kfifo_out_spinlocked(&deck->queue, &cmd, 1, &deck->lock))
+	{
+		memset(&deck->current_cmd, 0, sizeof(deck->current_cmd));
+		deck->current_cmd.tag = cmd.tag;
+		deck_complete(deck, -ECANCELED);
+	}
+
+	return 0;
+}
+
+/*
+ * Called from the serial RX interrupt while the port is in deck mode.
+ */
+void blackmagic_deck_rx_interrupt(struct blackmagic_device *ddev)
+{
+	struct blackmagic_deck *deck = ACCESS_ONCE(ddev->deck);
+
+	if (deck && !deck->loopback)
+		wake_up_interruptible(&deck->wait);
+}
+
+static int blackmagic_deck_open(struct blackmagic_device *ddev, struct file *filp, const struct blackmagic_deck_config *config)
+{
+	struct blackmagic_deck *deck;
+	int ret = 0;
+
+	if (config->offset_us > DECK_MAX_OFFSET_US || (config->flags & ~BLACKMAGIC_DECK_LOOPBACK))
+		return -EINVAL;
+
+	deck = kzalloc(sizeof(*deck), GFP_KERNEL);
+	if (!deck)
+		return -ENOMEM;
+
+	deck->ddev = ddev;
+	deck->owner = filp;
+	deck->loopback = config->flags & BLACKMAGIC_DECK_LOOPBACK;
+	deck->offset = config->offset_us * (unsigned long long)NSEC_PER_USEC;
+	deck->timeout = (config->timeout_ms ? config->timeout_ms : DECK_DEFAULT_TIMEOUT_MS) * (unsigned long long)NSEC_PER_MSEC;
+	atomic_set(&deck->users, 0);
+	atomic_set(&deck->done_overflow, 0);
+	init_waitqueue_head(&deck->wait);
+	spin_lock_init(&deck->lock);
+	INIT_KFIFO(deck->queue);
+	INIT_KFIFO(deck->done);
+	INIT_KFIFO(deck->loop_fifo);
+	blackmagic_field_clock_init(&deck->loop_clock);
+	deck->loop_next_field = dl_uptime();
+	deck->clock = deck->loopback ? &deck->loop_clock : &ddev->field_clock;
+
+	mutex_lock(&ddev->deck_mutex);
+
+	if (ddev->deck)
+	{
+		ret = -EBUSY;
+		goto fail;
+	}
+
+	if (!deck->loopback)
+	{
+		ret = blackmagic_serial_open_deck(ddev);
+		if (ret < 0)
+			goto fail;
+	}
+
+	deck->thread = kthread_run(blackmagic_deck_thread, deck, "bmd-deck/%d", ddev->id);
+	if (IS_ERR(deck->thread))
+	{
+		ret = PTR_ERR(deck->thread);
+		if (!deck->loopback)
+			blackmagic_serial_close_deck(ddev);
+		goto fail;
+	}
+
+	ddev->deck = deck;
+	mutex_unlock(&ddev->deck_mutex);
+	return 0;
+
+fail:
+	mutex_unlock(&ddev->deck_mutex);
+	kfree(deck);
+	return ret;
+}
+
+/* Called with ddev->deck_mutex held */
+static void blackmagic_deck_close(struct blackmagic_device *ddev)
+{
+	struct blackmagic_deck *deck = ddev->deck;
+
+	kthread_stop(deck->thread);
+
+	if (!deck->loopback)
+		blackmagic_serial_close_deck(ddev);
+
+	/* Make sure the RX interrupt is done with the deck */
+	ddev->deck = NULL;
+	blackmagic_synchronize_isr(ddev);
+
+	/* Wait until clients inside blackmagic_deck_complete have left */
+	deck->closing = true;
+	wake_up_interruptible_all(&ddev->deck_wait);
+	wait_event(ddev->deck_wait, atomic_read(&deck->users) == 0);
+
+	if (atomic_read(&deck->done_overflow))
+		dl_info("deck: dropped %d uncollected completions\n", atomic_read(&deck->done_overflow));
+
+	kfree(deck);
+}
+
+static int blackmagic_deck_submit(struct blackmagic_device *ddev, struct file *filp, const struct blackmagic_deck_command *cmd)
+{
+	struct blackmagic_deck *deck;
+	int ret = 0;
+
+	if (cmd->length < 2 || cmd->length >= BLACKMAGIC_DECK_MAX_MSG || cmd->length != deck_msg_length(cmd->data[0]))
+		return -EINVAL;
+
+	mutex_lock(&ddev->deck_mutex);
+
+	deck = ddev->deck;
+	if (!deck || deck->owner != filp)
+		ret = -EBADF;
+	else if (!kfifo_in_spinlocked(&deck->queue, cmd, 1, &deck->lock))
+		ret = -EAGAIN;
+	else
+		wake_up_interruptible(&deck->wait);
+
+	mutex_unlock(&ddev->deck_mutex);
+
+	return ret;
+}
+
+static bool deck_done_ready(struct blackmagic_deck *deck)
+{
+	return !kfifo_is_empty(&deck->done) || deck->closing;
+}
+
+static int blackmagic_deck_complete(struct blackmagic_device *ddev, struct file *filp, const struct blackmagic_deck_wait *wait)
+{
+	struct blackmagic_deck_completion __user *dst = (struct blackmagic_deck_completion __user *)(unsigned long)wait->completions;
+	struct blackmagic_deck_completion c;
+	struct blackmagic_deck *deck;
+	long timeout;
+	int total = 0;
+	int ret = 0;
+
+	mutex_lock(&ddev->deck_mutex);
+	deck = ddev->deck;
+	if (deck && deck->owner == filp)
+		atomic_inc(&deck->users);
+	else
+		deck = NULL;
+	mutex_unlock(&ddev->deck_mutex);
+
+	if (!deck)
+		return -EBADF;
+
+	if (wait->timeout_ms == BLACKMAGIC_WAIT_FOREVER)
+		timeout = MAX_SCHEDULE_TIMEOUT;
+	else
+		timeout = msecs_to_jiffies(wait->timeout_ms);
+
+	if (kfifo_is_empty(&deck->done) && timeout)
+	{
+		ret = wait_event_interruptible_timeout(ddev->deck_wait, deck_done_ready(deck), timeout);
+		if (ret < 0)
+			goto out;
+	}
+
+	while (total < wait->count && kfifo_out_spinlocked(&deck->done, &c, 1, &deck->lock))
+	{
+		if (copy_to_user(dst + total, &c, sizeof(c)))
+		{
+			ret = -EFAULT;
+			goto out;
+		}
+		total++;
+	}
+
+	ret = total ? total : -ETIMEDOUT;
+
+out:
+	/* The deck may be freed as soon as users drops to zero */
+	if (atomic_dec_and_test(&deck->users))
+		wake_up_all(&ddev->deck_wait);
+	return ret;
+}
+
+long blackmagic_deck_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct blackmagic_deck_config config;
+	struct blackmagic_deck_command command;
+	struct blackmagic_deck_wait wait;
+	int ret;
+
+	switch (cmd)
+	{
+		case BLACKMAGIC_IOC_DECK_OPEN:
+			if (copy_from_user(&config, (void __user *)arg, sizeof(config)))
+				return -EFAULT;
+			if (!(config.flags & BLACKMAGIC_DECK_LOOPBACK) && !ddev->sdev)
+				return -ENODEV;
+			return blackmagic_deck_open(ddev, filp, &config);
+
+		case BLACKMAGIC_IOC_DECK_CLOSE:
+			mutex_lock(&ddev->deck_mutex);
+			ret = -EBADF;
+			if (ddev->deck && ddev->deck->owner == filp)
+			{
+				blackmagic_deck_close(ddev);
+				ret = 0;
+			}
+			mutex_unlock(&ddev->deck_mutex);
+			return ret;
+
+		case BLACKMAGIC_IOC_DECK_SUBMIT:
+			if (copy_from_user(&command, (void __user *)arg, sizeof(command)))
+				return -EFAULT;
+			return blackmagic_deck_submit(ddev, filp, &command);
+
+		case BLACKMAGIC_IOC_DECK_COMPLETE:
+			if (copy_from_user(&wait, (void __user *)arg, sizeof(wait)))
+				return -EFAULT;
+			return blackmagic_deck_complete(ddev, filp, &wait);
+	}
+
+	return -ENOTTY;
+}
+
+/*
+ * Completions are reported as POLLRDBAND, like serial data in IOCTL mode.
+ */
+unsigned int blackmagic_deck_poll(struct blackmagic_device *ddev, struct file *filp, poll_table *wait)
+{
+	struct blackmagic_deck *deck;
+	unsigned int mask = 0;
+
+	mutex_lock(&ddev->deck_mutex);
+	deck = ddev->deck;
+	if (deck && deck->owner == filp)
+	{
+		poll_wait(filp, &ddev->deck_wait, wait);
+		if (!kfifo_is_empty(&deck->done))
+			mask |= POLLRDBAND;
+	}
+	mutex_unlock(&ddev->deck_mutex);
+
+	return mask;
+}
+
+/*
+ * Stop the engine when the device goes away, whoever owns it.
+ */
+void blackmagic_deck_remove(struct blackmagic_device *ddev)
+{
+	mutex_lock(&ddev->deck_mutex);
+	if (ddev->deck)
+		blackmagic_deck_close(ddev);
+	mutex_unlock(&ddev->deck_mutex);
+}
+
+/*
+ * The deck engine belongs to the file that opened it.
+ */
+void blackmagic_deck_release(struct blackmagic_device *ddev, struct file *filp)
+{
+	mutex_lock(&ddev->deck_mutex);
+	if (ddev->deck && ddev->deck->owner == filp)
+		blackmagic_deck_close(ddev);
+	mutex_unlock(&ddev->deck_mutex);
+}
@@ -0,0 +1,88 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+#ifndef BLACKMAGIC_DECK_H
+#define BLACKMAGIC_DECK_H
+
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include "blackmagic_core.h"
+#include "blackmagic_ioctl.h"
+
+/*
+ * Sony 9-pin deck control engine. One per device, created when a client
+ * opens the serial port in deck mode and owned by that client's file.
+ */
+#define BLACKMAGIC_DECK_QUEUE_SIZE		16
+#define BLACKMAGIC_DECK_DONE_SIZE		64
+
+struct blackmagic_deck
+{
+	struct blackmagic_device *ddev;
+	struct file *owner;
+	struct task_struct *thread;
+	bool loopback;
+	bool closing;
+	unsigned long long offset;				/* Transmit offset from field start, ns */
+	unsigned long long timeout;				/* Response timeout, ns */
+	atomic_t users;							/* Clients inside blackmagic_deck_complete */
+
+	wait_queue_head_t wait;					/* Engine thread; clients wait on ddev->deck_wait */
+	spinlock_t lock;						/* Protects queue and done */
+	DECLARE_KFIFO(queue, struct blackmagic_deck_command, BLACKMAGIC_DECK_QUEUE_SIZE);
+	DECLARE_KFIFO(done, struct blackmagic_deck_completion, BLACKMAGIC_DECK_DONE_SIZE);
+	atomic_t done_overflow;
+
+	struct blackmagic_field_clock *clock;	/* The device's, or loop_clock */
+
+	/* Stamp of the RX batch being parsed */
+	unsigned long long rx_time;
+	unsigned int rx_field;
+
+	/* Command in flight and the response being assembled (engine thread only) */
+	bool busy;
+	struct blackmagic_deck_completion current_cmd;
+	unsigned long long deadline;
+	unsigned char rx_msg[BLACKMAGIC_DECK_MAX_MSG + 1];
+	unsigned int rx_len;
+	unsigned long long rx_msg_time;
+	unsigned int rx_msg_field;
+
+	/* Simulated deck for loopback mode */
+	DECLARE_KFIFO(loop_fifo, unsigned char, 64);
+	struct blackmagic_field_clock loop_clock;
+	unsigned long long loop_next_field;
+};
+
+void blackmagic_deck_rx_interrupt(struct blackmagic_device *ddev);
+long blackmagic_deck_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd, unsigned long arg);
+unsigned int blackmagic_deck_poll(struct blackmagic_device *ddev, struct file *filp, poll_table *wait);
+void blackmagic_deck_release(struct blackmagic_device *ddev, struct file *filp);
+void blackmagic_deck_remove(struct blackmagic_device *ddev);
+
+#endif
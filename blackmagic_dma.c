@@ -53,6 +53,7 @@
 #include <asm/uaccess.h>
 
 #include "blackmagic_lib.h"
+#include "blackmagic_trace.h"
 
 struct dl_dma_entry
 {
@@ -68,6 +69,7 @@ struct dl_dma_list
 		unsigned int	 size;
 	};
 	uint8_t				 dma_is_single;
+	void*				 cache;		/* Pinned region whose mapping this borrows */
 };
 
 #define first_entry(x) \
@@ -123,10 +125,41 @@ dl_dma_map_user_buffer(void* page_array, unsigned long num_pages, int direction,
 	struct dl_dma_list* sl 				= NULL;
 	struct dl_dma_entry *e				= NULL;
 	struct page** pages = (struct page**)page_array;
+	struct dl_dma_list* cached			= NULL;
+	void* region						= NULL;
+	unsigned long first					= 0;
 
 	if (!page_array)
 		return NULL;
 
+	// Pages from a region pinned with BLACKMAGIC_IOC_PIN are already mapped
+	cached = dl_pinned_dma_lookup(page_array, pdev, &region, &first);
+	if (cached)
+	{
+		sl = alloc_dl_dma_entry(num_pages);
+		if (!sl)
+		{
+			dl_pinned_region_put(region);
+			return NULL;
+		}
+
+		memcpy(first_entry(sl), get_entry(first_entry(cached), first), num_pages * sizeof(struct dl_dma_entry));
+		sl->num_pages = num_pages;
+		sl->pdev = pdev;
+		sl->cache = region;
+
+		// The region stays mapped between transfers, so hand this range to the device
+		e = first_entry(sl);
+		for (i = 0; i < num_pages; i++)
+		{
+			pci_dma_sync_single_for_device(sl->pdev, e->dma_addr, PAGE_SIZE, PCI_DMA_BIDIRECTIONAL);
+			e = next_entry(e);
+		}
+
+		blackmagic_trace(BLACKMAGIC_TRACE_DMA_MAP, num_pages, (unsigned long)sl);
+		return sl;
+	}
+
 	sl = alloc_dl_dma_entry(num_pages);
 	if (!sl)
 		return NULL;
@@ -142,6 +175,8 @@ dl_dma_map_user_buffer(void* page_array, unsigned long num_pages, int direction,
 
 	sl->num_pages = num_pages;
 	sl->pdev = pdev;	
+
+	blackmagic_trace(BLACKMAGIC_TRACE_DMA_MAP, num_pages, (unsigned long)sl);
 	
 	return sl;
 }
@@ -183,6 +218,8 @@ dl_dma_map_kernel_buffer(void *address, unsigned long size, int direction, int i
 		sl->size = size;
 	}
 	sl->pdev = pdev;	
+
+	blackmagic_trace(BLACKMAGIC_TRACE_DMA_MAP, sl->dma_is_single ? sl->size : sl->num_pages, (unsigned long)sl);
 	return sl;
 }
 
@@ -222,7 +259,19 @@ void dl_dma_unmap_kernel_buffer(struct dl_dma_list* sl, int direction)
 	
 	direction = bmd_to_linux_direction(direction);
 
-	if (!sl->dma_is_single)
+	blackmagic_trace(BLACKMAGIC_TRACE_DMA_UNMAP, sl->dma_is_single ? sl->size : sl->num_pages, (unsigned long)sl);
+
+	if (sl->cache)
+	{
+		// The mapping belongs to the pinned region; just give the range back to the CPU
+		for (i = 0; i < sl->num_pages; i++)
+		{
+			pci_dma_sync_single_for_cpu(sl->pdev, e->dma_addr, PAGE_SIZE, PCI_DMA_BIDIRECTIONAL);
+			e = next_entry(e);
+		}
+		dl_pinned_region_put(sl->cache);
+	}
+	else if (!sl->dma_is_single)
 	{
 		for (i = 0; i < sl->num_pages; i++)
 		{
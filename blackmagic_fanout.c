@@ -0,0 +1,670 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+#include "blackmagic_fanout.h"
+
+/*
+ * Capture fan-out: one publisher, any number of subscribers. Frames stay in
+ * the publisher's memory, pinned, and are mapped into subscribers with
+ * vm_insert_page. fanout->lock protects everything but the frame refcounts.
+ * Waiters sleep on record_events rather than taking the lock in their wait
+ * condition.
+ */
+
+static void fanout_frame_release(struct kref *ref)
+{
+	struct blackmagic_fanout_frame *frame = container_of(ref, struct blackmagic_fanout_frame, ref);
+
+	dl_unmap_user_pages(frame->pages, frame->nr_pages, 0);
+	kfree(frame);
+}
+
+static struct blackmagic_fanout_subscriber *fanout_find_subscriber(struct blackmagic_fanout *fanout, struct file *filp)
+{
+	struct blackmagic_fanout_subscriber *sub;
+
+	list_for_each_entry(sub, &fanout->subscribers, entry)
+	{
+		if (sub->filp == filp)
+			return sub;
+	}
+
+	return NULL;
+}
+
+/* Every subscriber is done with the frame: hand it back to the publisher */
+static void fanout_retire(struct blackmagic_fanout *fanout, struct blackmagic_fanout_frame *frame)
+{
+	fanout->frames[frame->slot] = NULL;
+
+	if (fanout->publisher)
+	{
+		kfifo_in(&fanout->reclaimed, &frame->cookie, 1);
+		wake_up_interruptible(&fanout->reclaim_wait);
+	}
+
+	kref_put(&frame->ref, fanout_frame_release);
+}
+
+static void fanout_reader_done(struct blackmagic_fanout *fanout, struct blackmagic_fanout_subscriber *sub, unsigned int slot)
+{
+	struct blackmagic_fanout_frame *frame = fanout->frames[slot];
+
+	clear_bit(slot, sub->held);
+	if (frame && --frame->readers == 0)
+		fanout_retire(fanout, frame);
+}
+
+static void fanout_remove_subscriber(struct blackmagic_fanout *fanout, struct blackmagic_fanout_subscriber *sub)
+{
+	unsigned int slot;
+
+	for (slot = 0; slot < BLACKMAGIC_FANOUT_SLOTS; slot++)
+	{
+		if (test_bit(slot, sub->held))
+			fanout_reader_done(fanout, sub, slot);
+	}
+
+	list_del(&sub->entry);
+	kfree(sub);
+}
+
+static int fanout_publisher(struct blackmagic_fanout *fanout, struct file *filp, bool start)
+{
+	int ret = 0;
+
+	mutex_lock(&fanout->lock);
+	if (start)
+	{
+		if (!fanout->publisher)
+		{
+			fanout->publisher = filp;
+			kfifo_reset(&fanout->reclaimed);
+		}
+		else if (fanout->publisher != filp)
+		{
+			ret = -EBUSY;
+		}
+	}
+	else if (fanout->publisher == filp)
+	{
+		/* Frames still being read are dropped when released */
+		fanout->publisher = NULL;
+		kfifo_reset(&fanout->reclaimed);
+		wake_up_interruptible(&fanout->reclaim_wait);
+	}
+	mutex_unlock(&fanout->lock);
+
+	return ret;
+}
+
+static int fanout_subscribe(struct blackmagic_fanout *fanout, struct file *filp, bool start)
+{
+	struct blackmagic_fanout_subscriber *sub, *new_sub = NULL;
+
+	if (start)
+	{
+		new_sub = kzalloc(sizeof(*new_sub), GFP_KERNEL);
+		if (!new_sub)
+			return -ENOMEM;
+		new_sub->filp = filp;
+		INIT_KFIFO(new_sub->records);
+	}
+
+	mutex_lock(&fanout->lock);
+	sub = fanout_find_subscriber(fanout, filp);
+	if (start && !sub)
+	{
+		list_add_tail(&new_sub->entry, &fanout->subscribers);
+		new_sub = NULL;
+	}
+	else if (!start && sub)
+	{
+		fanout_remove_subscriber(fanout, sub);
+		fanout->record_events++;
+		wake_up_interruptible(&fanout->record_wait);
+	}
+	mutex_unlock(&fanout->lock);
+
+	kfree(new_sub);
+	return 0;
+}
+
+static int fanout_publish(struct blackmagic_fanout *fanout, struct file *filp, unsigned long arg)
+{
+	struct blackmagic_fanout_publish pub;
+	struct blackmagic_fanout_subscriber *sub;
+	struct blackmagic_fanout_frame *frame;
+	struct blackmagic_fanout_record record;
+	unsigned long i;
+	unsigned int slot;
+	int ret = 0;
+
+	if (copy_from_user(&pub, (void __user *)arg, sizeof(pub)))
+		return -EFAULT;
+
+	if (!pub.addr || !pub.length || pub.length > BLACKMAGIC_MMAP_FANOUT_SPAN - PAGE_SIZE)
+		return -EINVAL;
+
+	if (ACCESS_ONCE(fanout->publisher) != filp)
+		return -EPERM;
+
+	frame = kzalloc(sizeof(*frame), GFP_KERNEL);
+	if (!frame)
+		return -ENOMEM;
+
+	/* Pin outside the lock; frames in a BLACKMAGIC_IOC_PIN region are already resident */
+	kref_init(&frame->ref);
+	frame->cookie = pub.cookie;
+	frame->timestamp = pub.timestamp;
+	frame->addr = (unsigned long)pub.addr;
+	frame->length = (unsigned long)pub.length;
+	frame->pages = dl_get_user_pages(current, (void *)frame->addr, frame->length, &frame->nr_pages, DL_DMA_TO_DEVICE);
+	if (!frame->pages)
+	{
+		kfree(frame);
+		return -EFAULT;
+	}
+
+	/* vm_insert_page only maps page cache pages, e.g. shmem, into subscribers */
+	for (i = 0; i < frame->nr_pages; i++)
+	{
+		if (PageAnon(frame->pages[i]))
+		{
+			kref_put(&frame->ref, fanout_frame_release);
+			return -EINVAL;
+		}
+	}
+
+	mutex_lock(&fanout->lock);
+	if (fanout->publisher != filp)
+	{
+		ret = -EPERM;
+		goto fail;
+	}
+
+	for (slot = 0; slot < BLACKMAGIC_FANOUT_SLOTS; slot++)
+	{
+		if (!fanout->frames[slot])
+			break;
+	}
+	if (slot == BLACKMAGIC_FANOUT_SLOTS)
+	{
+		ret = -EBUSY;
+		goto fail;
+	}
+
+	frame->slot = slot;
+	frame->seq = fanout->next_seq++;
+	fanout->frames[slot] = frame;
+
+	record.seq = frame->seq;
+	record.cookie = frame->cookie;
+	record.timestamp = frame->timestamp;
+	record.mmap_offset = BLACKMAGIC_MMAP_FANOUT_BASE + slot * BLACKMAGIC_MMAP_FANOUT_SPAN;
+	record.length = frame->length;
+	record.page_offset = offset_in_page(frame->addr);
+	record.reserved = 0;
+
+	list_for_each_entry(sub, &fanout->subscribers, entry)
+	{
+		if (kfifo_in(&sub->records, &record, 1))
+		{
+			set_bit(slot, sub->held);
+			frame->readers++;
+		}
+		else
+		{
+			sub->dropped++;
+		}
+	}
+
+	pub.seq = frame->seq;
+	if (frame->readers)
+	{
+		fanout->record_events++;
+		wake_up_interruptible(&fanout->record_wait);
+	}
+	else
+		fanout_retire(fanout, frame);
+	mutex_unlock(&fanout->lock);
+
+	if (copy_to_user((void __user *)arg, &pub, sizeof(pub)))
+		return -EFAULT;
+	return 0;
+
+fail:
+	mutex_unlock(&fanout->lock);
+	kref_put(&frame->ref, fanout_frame_release);
+	return ret;
+}
+
+/* Sampled before looking for records; any change since means look again */
+static unsigned long fanout_record_events(struct blackmagic_fanout *fanout)
+{
+	unsigned long events = ACCESS_ONCE(fanout->record_events);
+
+	smp_rmb();
+	return events;
+}
+
+static bool fanout_reclaim_ready(struct blackmagic_fanout *fanout, struct file *filp)
+{
+	return ACCESS_ONCE(fanout->publisher) != filp || !kfifo_is_empty(&fanout->reclaimed);
+}
+
+static long fanout_wait_timeout(const struct blackmagic_fanout_wait *wait)
+{
+	if (wait->timeout_ms == BLACKMAGIC_WAIT_FOREVER)
+		return MAX_SCHEDULE_TIMEOUT;
+	return msecs_to_jiffies(wait->timeout_ms);
+}
+
+static int fanout_read(struct blackmagic_fanout *fanout, struct file *filp, const struct blackmagic_fanout_wait *wait)
+{
+	struct blackmagic_fanout_record __user *dst = (struct blackmagic_fanout_record __user *)(unsigned long)wait->records;
+	struct blackmagic_fanout_subscriber *sub;
+	struct blackmagic_fanout_record record;
+	long timeout = fanout_wait_timeout(wait);
+	unsigned long events;
+	int total = 0;
+	int ret;
+
+	mutex_lock(&fanout->lock);
+	for (;;)
+	{
+		sub = fanout_find_subscriber(fanout, filp);
+		if (!sub)
+		{
+			ret = -EBADF;
+			goto out;
+		}
+
+		if (!kfifo_is_empty(&sub->records) || !timeout)
+			break;
+
+		events = fanout->record_events;
+		mutex_unlock(&fanout->lock);
+		timeout = wait_event_interruptible_timeout(fanout->record_wait,
+			fanout_record_events(fanout) != events, timeout);
+		if (timeout < 0)
+			return timeout;
+		mutex_lock(&fanout->lock);
+	}
+
+	while (total < wait->count && kfifo_peek(&sub->records, &record))
+	{
+		if (copy_to_user(dst + total, &record, sizeof(record)))
+		{
+			ret = -EFAULT;
+			goto out;
+		}
+		kfifo_skip(&sub->records);
+		total++;
+	}
+
+	ret = total ? total : -ETIMEDOUT;
+
+out:
+	mutex_unlock(&fanout->lock);
+	return ret;
+}
+
+static int fanout_reclaim(struct blackmagic_fanout *fanout, struct file *filp, const struct blackmagic_fanout_wait *wait)
+{
+	__u64 __user *dst = (__u64 __user *)(unsigned long)wait->records;
+	long timeout = fanout_wait_timeout(wait);
+	__u64 cookie;
+	int total = 0;
+	int ret;
+
+	if (timeout && !fanout_reclaim_ready(fanout, filp))
+	{
+		ret = wait_event_interruptible_timeout(fanout->reclaim_wait, fanout_reclaim_ready(fanout, filp), timeout);
+		if (ret < 0)
+			return ret;
+	}
+
+	mutex_lock(&fanout->lock);
+	if (fanout->publisher != filp)
+	{
+		ret = -EBADF;
+		goto out;
+	}
+
+	while (total < wait->count && kfifo_peek(&fanout->reclaimed, &cookie))
+	{
+		if (put_user(cookie, dst + total))
+		{
+			ret = -EFAULT;
+			goto out;
+		}
+		kfifo_skip(&fanout->reclaimed);
+		total++;
+	}
+
+	ret = total ? total : -ETIMEDOUT;
+
+out:
+	mutex_unlock(&fanout->lock);
+	return ret;
+}
+
+static int fanout_release_frame(struct blackmagic_fanout *fanout, struct file *filp, __u64 seq)
+{
+	struct blackmagic_fanout_subscriber *sub;
+	unsigned int slot;
+	int ret = -EINVAL;
+
+	mutex_lock(&fanout->lock);
+	sub = fanout_find_subscriber(fanout, filp);
+	for (slot = 0; sub && slot < BLACKMAGIC_FANOUT_SLOTS; slot++)
+	{
+		if (test_bit(slot, sub->held) && fanout->frames[slot] && fanout->frames[slot]->seq == seq)
+		{
+			fanout_reader_done(fanout, sub, slot);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&fanout->lock);
+
+	return ret;
+}
+
+long blackmagic_fanout_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct blackmagic_fanout *fanout = ddev->fanout;
+	struct blackmagic_fanout_wait wait;
+	__u32 start;
+	__u64 seq;
+
+	if (!fanout)
+		return -ENODEV;
+
+	switch (cmd)
+	{
+		case BLACKMAGIC_IOC_FANOUT_PUBLISHER:
+			if (get_user(start, (__u32 __user *)arg))
+				return -EFAULT;
+			return fanout_publisher(fanout, filp, start != 0);
+
+		case BLACKMAGIC_IOC_FANOUT_PUBLISH:
+			return fanout_publish(fanout, filp, arg);
+
+		case BLACKMAGIC_IOC_FANOUT_RECLAIM:
+			if (copy_from_user(&wait, (void __user *)arg, sizeof(wait)))
+				return -EFAULT;
+			return fanout_reclaim(fanout, filp, &wait);
+
+		case BLACKMAGIC_IOC_FANOUT_SUBSCRIBE:
+			if (get_user(start, (__u32 __user *)arg))
+				return -EFAULT;
+			return fanout_subscribe(fanout, filp, start != 0);
+
+		case BLACKMAGIC_IOC_FANOUT_READ:
+			if (copy_from_user(&wait, (void __user *)arg, sizeof(wait)))
+				return -EFAULT;
+			return fanout_read(fanout, filp, &wait);
+
+		case BLACKMAGIC_IOC_FANOUT_RELEASE:
+			if (get_user(seq, (__u64 __user *)arg))
+				return -EFAULT;
+			return fanout_release_frame(fanout, filp, seq);
+	}
+
+	return -ENOTTY;
+}
+
+/*
+ * Subscriber records and reclaimed frames are reported as POLLPRI.
+ */
+unsigned int blackmagic_fanout_poll(struct blackmagic_device *ddev, struct file *filp, poll_table *wait)
+{
+	struct blackmagic_fanout *fanout = ddev->fanout;
+	struct blackmagic_fanout_subscriber *sub;
+	unsigned int mask = 0;
+
+	if (!fanout)
+		return 0;
+
+	mutex_lock(&fanout->lock);
+	if (fanout->publisher == filp)
+	{
+		poll_wait(filp, &fanout->reclaim_wait, wait);
+		if (!kfifo_is_empty(&fanout->reclaimed))
+			mask |= POLLPRI;
+	}
+
+	sub = fanout_find_subscriber(fanout, filp);
+	if (sub)
+	{
+		poll_wait(filp, &fanout->record_wait, wait);
+		if (!kfifo_is_empty(&sub->records))
+			mask |= POLLPRI;
+	}
+	mutex_unlock(&fanout->lock);
+
+	return mask;
+}
+
+static void fanout_vm_open(struct vm_area_struct *vma)
+{
+	struct blackmagic_fanout_frame *frame = vma->vm_private_data;
+
+	kref_get(&frame->ref);
+}
+
+static void fanout_vm_close(struct vm_area_struct *vma)
+{
+	struct blackmagic_fanout_frame *frame = vma->vm_private_data;
+
+	kref_put(&frame->ref, fanout_frame_release);
+}
+
+static const struct vm_operations_struct fanout_vm_ops = {
+	.open = fanout_vm_open,
+	.close = fanout_vm_close,
+};
+
+/*
+ * Map a frame this subscriber has not yet released, read-only. The mapping
+ * keeps the pages, but the publisher may reuse them once the frame is released.
+ */
+int blackmagic_fanout_mmap(struct blackmagic_device *ddev, struct file *filp, struct vm_area_struct *vma)
+{
+	struct blackmagic_fanout *fanout = ddev->fanout;
+	unsigned long long offset = (unsigned long long)vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	struct blackmagic_fanout_subscriber *sub;
+	struct blackmagic_fanout_frame *frame = NULL;
+	unsigned long long slot;
+	unsigned long i;
+	int r;
+
+	if (!fanout)
+		return -ENODEV;
+
+	offset -= BLACKMAGIC_MMAP_FANOUT_BASE;
+	slot = div64_u64(offset, BLACKMAGIC_MMAP_FANOUT_SPAN);
+	if (slot >= BLACKMAGIC_FANOUT_SLOTS || offset != slot * BLACKMAGIC_MMAP_FANOUT_SPAN)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	mutex_lock(&fanout->lock);
+	sub = fanout_find_subscriber(fanout, filp);
+	if (sub && test_bit(slot, sub->held))
+	{
+		frame = fanout->frames[slot];
+		if (frame)
+			kref_get(&frame->ref);
+	}
+	mutex_unlock(&fanout->lock);
+
+	if (!frame)
+		return -EACCES;
+
+	if (len > frame->nr_pages << PAGE_SHIFT)
+	{
+		r = -EINVAL;
+		goto fail;
+	}
+
+	for (i = 0; i < len >> PAGE_SHIFT; i++)
+	{
+		r = vm_insert_page(vma, vma->vm_start + (i << PAGE_SHIFT), frame->pages[i]);
+		if (r < 0)
+			goto fail;
+	}
+
+	vma->vm_private_data = frame;
+	vma->vm_ops = &fanout_vm_ops;
+	return 0;
+
+fail:
+	kref_put(&frame->ref, fanout_frame_release);
+	return r;
+}
+
+/*
+ * In-kernel subscribers, keyed by a file of their own. blackmagic_fanout_next
+ * takes the next record and a reference on its frame, which the caller drops
+ * with blackmagic_fanout_put_frame before releasing the frame by seq. Sample
+ * blackmagic_fanout_events before draining records and sleep on record_wait
+ * until it changes.
+ */
+int blackmagic_fanout_subscribe(struct blackmagic_fanout *fanout, struct file *key, bool start)
+{
+	return fanout_subscribe(fanout, key, start);
+}
+
+unsigned long blackmagic_fanout_events(struct blackmagic_fanout *fanout)
+{
+	return fanout_record_events(fanout);
+}
+
+bool blackmagic_fanout_next(struct blackmagic_fanout *fanout, struct file *key,
+	struct blackmagic_fanout_record *record, struct blackmagic_fanout_frame **frame)
+{
+	struct blackmagic_fanout_subscriber *sub;
+	struct blackmagic_fanout_frame *f;
+	unsigned int slot;
+	bool found = false;
+
+	mutex_lock(&fanout->lock);
+	sub = fanout_find_subscriber(fanout, key);
+	while (sub && !found && kfifo_out(&sub->records, record, 1))
+	{
+		slot = div64_u64(record->mmap_offset - BLACKMAGIC_MMAP_FANOUT_BASE, BLACKMAGIC_MMAP_FANOUT_SPAN);
+		f = fanout->frames[slot];
+		if (f && f->seq == record->seq)
+		{
+			kref_get(&f->ref);
+			*frame = f;
+			found = true;
+		}
+	}
+	mutex_unlock(&fanout->lock);
+
+	return found;
+}
+
+void blackmagic_fanout_put_frame(struct blackmagic_fanout_frame *frame)
+{
+	kref_put(&frame->ref, fanout_frame_release);
+}
+
+int blackmagic_fanout_release_frame(struct blackmagic_fanout *fanout, struct file *key, __u64 seq)
+{
+	return fanout_release_frame(fanout, key, seq);
+}
+
+void blackmagic_fanout_release(struct blackmagic_device *ddev, struct file *filp)
+{
+	struct blackmagic_fanout *fanout = ddev->fanout;
+
+	if (!fanout)
+		return;
+
+	fanout_publisher(fanout, filp, false);
+	fanout_subscribe(fanout, filp, false);
+}
+
+int blackmagic_fanout_init(struct blackmagic_device *ddev)
+{
+	struct blackmagic_fanout *fanout;
+
+	fanout = kzalloc(sizeof(*fanout), GFP_KERNEL);
+	if (!fanout)
+		return -ENOMEM;
+
+	mutex_init(&fanout->lock);
+	INIT_LIST_HEAD(&fanout->subscribers);
+	INIT_KFIFO(fanout->reclaimed);
+	init_waitqueue_head(&fanout->record_wait);
+	init_waitqueue_head(&fanout->reclaim_wait);
+
+	ddev->fanout = fanout;
+	return 0;
+}
+
+void blackmagic_fanout_remove(struct blackmagic_device *ddev)
+{
+	struct blackmagic_fanout *fanout = ddev->fanout;
+	struct blackmagic_fanout_subscriber *sub, *tmp;
+	unsigned int slot;
+
+	if (!fanout)
+		return;
+
+	mutex_lock(&fanout->lock);
+	fanout->publisher = NULL;
+	list_for_each_entry_safe(sub, tmp, &fanout->subscribers, entry)
+		fanout_remove_subscriber(fanout, sub);
+
+	for (slot = 0; slot < BLACKMAGIC_FANOUT_SLOTS; slot++)
+	{
+		if (fanout->frames[slot])
+			fanout_retire(fanout, fanout->frames[slot]);
+	}
+	mutex_unlock(&fanout->lock);
+
+	ddev->fanout = NULL;
+	kfree(fanout);
+}
@@ -0,0 +1,93 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+
+#ifndef BLACKMAGIC_FANOUT_H
+#define BLACKMAGIC_FANOUT_H
+
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include "blackmagic_core.h"
+#include "blackmagic_ioctl.h"
+
+#define BLACKMAGIC_FANOUT_RECORDS		32		/* Records queued per subscriber */
+
+/* A published frame. Held by its slot and by every mapping of it. */
+struct blackmagic_fanout_frame
+{
+	struct kref ref;
+	unsigned int slot;
+	__u64 seq;
+	__u64 cookie;
+	__u64 timestamp;
+	unsigned long addr;
+	unsigned long length;
+	struct page **pages;
+	unsigned long nr_pages;
+	unsigned int readers;					/* Subscribers that have not released it */
+};
+
+struct blackmagic_fanout_subscriber
+{
+	struct list_head entry;
+	struct file *filp;
+	DECLARE_KFIFO(records, struct blackmagic_fanout_record, BLACKMAGIC_FANOUT_RECORDS);
+	DECLARE_BITMAP(held, BLACKMAGIC_FANOUT_SLOTS);	/* Slots this subscriber still reads */
+	unsigned long dropped;					/* Frames skipped while the queue was full */
+};
+
+struct blackmagic_fanout
+{
+	struct mutex lock;
+	struct file *publisher;
+	__u64 next_seq;
+	struct blackmagic_fanout_frame *frames[BLACKMAGIC_FANOUT_SLOTS];
+	struct list_head subscribers;
+	unsigned long record_events;			/* Bumped when records are queued or a subscriber leaves */
+	DECLARE_KFIFO(reclaimed, __u64, BLACKMAGIC_FANOUT_SLOTS);
+	wait_queue_head_t record_wait;			/* Subscribers */
+	wait_queue_head_t reclaim_wait;			/* Publisher */
+};
+
+int blackmagic_fanout_init(struct blackmagic_device *ddev);
+void blackmagic_fanout_remove(struct blackmagic_device *ddev);
+long blackmagic_fanout_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd, unsigned long arg);
+unsigned int blackmagic_fanout_poll(struct blackmagic_device *ddev, struct file *filp, poll_table *wait);
+int blackmagic_fanout_mmap(struct blackmagic_device *ddev, struct file *filp, struct vm_area_struct *vma);
+void blackmagic_fanout_release(struct blackmagic_device *ddev, struct file *filp);
+
+int blackmagic_fanout_subscribe(struct blackmagic_fanout *fanout, struct file *key, bool start);
+unsigned long blackmagic_fanout_events(struct blackmagic_fanout *fanout);
+bool blackmagic_fanout_next(struct blackmagic_fanout *fanout, struct file *key,
+	struct blackmagic_fanout_record *record, struct blackmagic_fanout_frame **frame);
+void blackmagic_fanout_put_frame(struct blackmagic_fanout_frame *frame);
+int blackmagic_fanout_release_frame(struct blackmagic_fanout *fanout, struct file *key, __u64 seq);
+
+#endif
@@ -26,14 +26,24 @@
 */
 
 #include <linux/kernel.h>
+#include <linux/module.h>
 #include <linux/hash.h>
+#include <linux/math64.h>
 #include <linux/list.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+	#include <linux/sched/rt.h>
+#endif
 #include "blackmagic_iml.h"
 #include "blackmagic_core.h"
+#include "blackmagic_gate.h"
+#include "blackmagic_trace.h"
+
+extern void blackmagic_replace_device_gate(struct blackmagic_device *, struct blackmagic_gate *old,
+	struct blackmagic_gate *gate);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 33)
 	#define raw_spinlock_t spinlock_t
@@ -61,13 +71,38 @@
 	#define TASK_KILLABLE TASK_INTERRUPTIBLE
 #endif
 
-#define EVENT_TABLE_BITS 6
-#define EVENT_TABLE_SIZE (1 << EVENT_TABLE_BITS)
+#ifndef MIN_NICE
+	#define MIN_NICE -20
+#endif
+
+#define EVENT_TABLE_MIN_BITS 6
+#define EVENT_TABLE_MAX_BITS 12
+
+/*
+ * Priority mode: waiters are queued by scheduling priority rather than in
+ * FIFO order, and a higher priority task may take over a hand-off that has not
+ * yet run. This is not priority inheritance: the only boost is nice boosting,
+ * where a SCHED_OTHER holder is reniced to the nice value of a more important
+ * waiter until it lets go of the gate. Real-time holders are left alone, and
+ * an RT waiter boosts a SCHED_OTHER holder to the minimum nice value only.
+ * rt_mutex cannot be used here since its exports are GPL only.
+ */
+static bool blackmagic_gate_pi = false;
+module_param(blackmagic_gate_pi, bool, S_IRUGO);
+
+/*
+ * Number of sleep events preallocated per gate, i.e. the number of distinct
+ * keys that can be slept on at once before a sleeper has to allocate one.
+ * Extra events join the pool once their sleepers are done.
+ */
+static unsigned int blackmagic_gate_max_sleepers = 64;
+module_param(blackmagic_gate_max_sleepers, uint, S_IRUGO);
 
 struct blackmagic_gate_waiter
 {
 	struct task_struct	*task;
 	struct list_head	list;
+	int					prio;
 };
 
 struct blackmagic_gate_event
@@ -76,12 +111,14 @@ struct blackmagic_gate_event
 	wait_queue_head_t	wqh;
 	int					ref;
 	void*				event;
+	bool				pooled;		/* Part of event_pool rather than allocated on its own */
 };
 
 struct blackmagic_gate_event_waiter
 {
 	wait_queue_t		wait;
 	bool				triggered;
+	bool				owns_gate;		/* Gate handed over by dl_gate_unlock_and_wakeup_one */
 };
 
 struct blackmagic_gate
@@ -92,13 +129,42 @@ struct blackmagic_gate
 	struct blackmagic_gate_waiter	*next;
 	struct blackmagic_device		*dev;
 	bool							run_bh_on_unlock;
-	struct hlist_head				events[EVENT_TABLE_SIZE];
+	bool							pi;
+	struct task_struct				*owner;		/* Task holding the gate (pi mode only) */
+	spinlock_t						boost_lock;	/* Orders boosts against the owner undoing them */
+	struct task_struct				*boosted;	/* Owner currently reniced on behalf of a waiter */
+	long							boosted_nice;
+	struct task_struct				*holder;	/* Task holding the gate across a batch */
+	unsigned int					hold_depth;	/* Nested dl_gate_lock calls by the holder */
+	unsigned long long				acquired;	/* dl_uptime() when the gate was last taken */
+	struct hlist_head				*events;
+	unsigned int					event_bits;
+	unsigned int					active_events;
+	struct hlist_head				free_events;
+	struct blackmagic_gate_event	*event_pool;
+	struct blackmagic_gate_stats	stats;
 };
 
+static struct hlist_head *alloc_event_table(unsigned int bits, gfp_t flags)
+{
+	unsigned int i;
+	struct hlist_head *table = kmalloc(sizeof(struct hlist_head) << bits, flags);
+	if (!table)
+		return NULL;
+
+	for (i = 0; i < (1U << bits); ++i)
+		INIT_HLIST_HEAD(&table[i]);
+
+	return table;
+}
+
 struct blackmagic_gate *dl_alloc_gate(void)
 {
-	int i;
+	unsigned int i;
 	struct blackmagic_gate *gate = kmalloc(sizeof(struct blackmagic_gate), GFP_KERNEL);
+	if (!gate)
+		return NULL;
+
 	*gate = (struct blackmagic_gate) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 33)
 		.lock				= SPIN_LOCK_UNLOCKED,
@@ -110,22 +176,175 @@ struct blackmagic_gate *dl_alloc_gate(void)
 		.next				= NULL,
 		.dev				= NULL,
 		.run_bh_on_unlock	= false,
+		.pi					= blackmagic_gate_pi,
+		.owner				= NULL,
+		.boosted			= NULL,
+		.boosted_nice		= 0,
+		.holder				= NULL,
+		.hold_depth			= 0,
+		.acquired			= 0,
+		.events				= NULL,
+		.event_bits			= EVENT_TABLE_MIN_BITS,
+		.active_events		= 0,
+		.free_events		= HLIST_HEAD_INIT,
+		.event_pool			= NULL,
+		.stats				= { .pool_size = blackmagic_gate_max_sleepers },
 	};
 
-	for (i = 0; i < EVENT_TABLE_SIZE; ++i)
-		INIT_HLIST_HEAD(&gate->events[i]);
+	spin_lock_init(&gate->boost_lock);
+
+	gate->events = alloc_event_table(gate->event_bits, GFP_KERNEL);
+	if (!gate->events)
+		goto fail;
+
+	if (blackmagic_gate_max_sleepers)
+	{
+		gate->event_pool = kcalloc(blackmagic_gate_max_sleepers, sizeof(struct blackmagic_gate_event), GFP_KERNEL);
+		if (!gate->event_pool)
+			goto fail;
+	}
+
+	for (i = 0; i < blackmagic_gate_max_sleepers; ++i)
+		hlist_add_head(&gate->event_pool[i].list, &gate->free_events);
 
 	return gate;
+
+fail:
+	kfree(gate->events);
+	kfree(gate);
+	return NULL;
 }
 
 void dl_free_gate(struct blackmagic_gate *gate)
 {
+	struct blackmagic_gate_event *ev;
+	struct hlist_node *tmp;
+
+	if (gate->dev)
+		blackmagic_replace_device_gate(gate->dev, gate, NULL);
+
+	if (gate->stats.holds)
+		dl_info("gate held %lu times, average %llu ns, longest %llu ns\n",
+			gate->stats.holds, div64_u64(gate->stats.hold_time, gate->stats.holds),
+			gate->stats.max_hold);
+
+	if (gate->stats.pool_exhausted)
+		dl_info("gate event pool of %lu exhausted %lu times (%lu allocation failures, peak %lu sleeping keys)\n",
+			gate->stats.pool_size, gate->stats.pool_exhausted,
+			gate->stats.alloc_failures, gate->stats.max_active);
+
+	while (!hlist_empty(&gate->free_events))
+	{
+		tmp = gate->free_events.first;
+		ev = hlist_entry(tmp, struct blackmagic_gate_event, list);
+		hlist_del(tmp);
+		if (!ev->pooled)
+			kfree(ev);
+	}
+
+	kfree(gate->event_pool);
+	kfree(gate->events);
 	kfree(gate);
 }
 
+void dl_gate_get_stats(struct blackmagic_gate *gate, struct blackmagic_gate_stats *stats)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&gate->lock, flags);
+	*stats = gate->stats;
+	raw_spin_unlock_irqrestore(&gate->lock, flags);
+}
+
 void dl_gate_set_device(struct blackmagic_gate *gate, void *dev)
 {
 	gate->dev = dev;
+	if (dev)
+		blackmagic_replace_device_gate(gate->dev, gate->dev->gate, gate);
+}
+
+/* Hold time accounting, called with gate->lock held */
+static inline void gate_acquired(struct blackmagic_gate *gate)
+{
+	gate->acquired = dl_uptime();
+}
+
+static inline void gate_released(struct blackmagic_gate *gate)
+{
+	unsigned long long held = dl_uptime() - gate->acquired;
+
+	gate->stats.holds++;
+	gate->stats.hold_time += held;
+	if (held > gate->stats.max_hold)
+		gate->stats.max_hold = held;
+}
+
+/*
+ * Called with gate->lock held, like every other access to holder and
+ * hold_depth. Bottom halves never nest, even when they interrupt the holder.
+ */
+static inline bool gate_held_by_current(struct blackmagic_gate *gate)
+{
+	return !in_interrupt() && gate->holder == current;
+}
+
+/*
+ * Insert a waiter in front of the first queued waiter with a lower priority
+ * (higher prio value), keeping FIFO order among waiters of equal priority.
+ */
+static void gate_pi_enqueue(struct blackmagic_gate *gate, struct blackmagic_gate_waiter *waiter)
+{
+	struct blackmagic_gate_waiter *pos;
+
+	list_for_each_entry(pos, &gate->wait_list, list)
+	{
+		if (pos->prio > waiter->prio)
+		{
+			list_add_tail(&waiter->list, &pos->list);
+			return;
+		}
+	}
+	list_add_tail(&waiter->list, &gate->wait_list);
+}
+
+/*
+ * Renice owner to the waiting task's nice value. set_user_nice takes the
+ * runqueue lock, so this runs with gate->lock dropped. owner is rechecked
+ * under boost_lock: the owner clears gate->owner before taking boost_lock to
+ * undo its boost, so a task seen here as the owner is still around and will
+ * undo whatever is done to it.
+ */
+static void gate_pi_boost(struct blackmagic_gate *gate, struct task_struct *owner)
+{
+	long nice = rt_task(current) ? MIN_NICE : task_nice(current);
+
+	spin_lock(&gate->boost_lock);
+	if (ACCESS_ONCE(gate->owner) == owner && !rt_task(owner) && nice < task_nice(owner) &&
+		(!gate->boosted || gate->boosted == owner))
+	{
+		if (!gate->boosted)
+		{
+			gate->boosted = owner;
+			gate->boosted_nice = task_nice(owner);
+		}
+		set_user_nice(owner, nice);
+	}
+	spin_unlock(&gate->boost_lock);
+}
+
+/* Undo any boost once current has let go of the gate, with gate->lock dropped */
+static void gate_pi_unboost(struct blackmagic_gate *gate)
+{
+	if (!gate->pi || in_interrupt())
+		return;
+
+	spin_lock(&gate->boost_lock);
+	if (gate->boosted == current)
+	{
+		set_user_nice(current, gate->boosted_nice);
+		gate->boosted = NULL;
+	}
+	spin_unlock(&gate->boost_lock);
 }
 
 static void __sched __dl_gate_lock(struct blackmagic_gate *gate)
@@ -136,13 +355,32 @@ static void __sched __dl_gate_lock(struct blackmagic_gate *gate)
 	{
 		--gate->count;
 	}
+	else if (gate->pi && gate->next != NULL && gate->next->prio > current->prio)
+	{
+		// The gate has been handed to a less important task that has not run
+		// yet, so take it over and put that task back in the queue.
+		gate_pi_enqueue(gate, gate->next);
+		gate->next = NULL;
+	}
 	else
 	{
 		struct task_struct *task = current;
+		struct task_struct *boost = NULL;
+		bool first = true;
 		struct blackmagic_gate_waiter waiter;
 
-		list_add_tail(&waiter.list, &gate->wait_list);
 		waiter.task = task;
+		waiter.prio = task->prio;
+		if (gate->pi)
+		{
+			gate_pi_enqueue(gate, &waiter);
+			if (gate->owner != task)
+				boost = gate->owner;
+		}
+		else
+		{
+			list_add_tail(&waiter.list, &gate->wait_list);
+		}
 
 		for (;;)
 		{
@@ -153,6 +391,14 @@ static void __sched __dl_gate_lock(struct blackmagic_gate *gate)
 			}
 			__set_task_state(task, TASK_UNINTERRUPTIBLE);
 			raw_spin_unlock_irq(&gate->lock);
+			if (first)
+			{
+				// Drop any boost left from an earlier hold, then boost the owner
+				gate_pi_unboost(gate);
+				if (boost)
+					gate_pi_boost(gate, boost);
+				first = false;
+			}
 			timeout = schedule_timeout(timeout);
 			raw_spin_lock_irq(&gate->lock);
 			if (gate->next == &waiter)
@@ -162,6 +408,10 @@ static void __sched __dl_gate_lock(struct blackmagic_gate *gate)
 			}
 		}
 	}
+
+	if (gate->pi)
+		gate->owner = current;
+	gate_acquired(gate);
 }
 
 void __sched dl_gate_lock(struct blackmagic_gate *gate)
@@ -169,8 +419,16 @@ void __sched dl_gate_lock(struct blackmagic_gate *gate)
 	unsigned long flags;
 
 	raw_spin_lock_irqsave(&gate->lock, flags);
-		__dl_gate_lock(gate);
+	if (gate_held_by_current(gate))
+	{
+		++gate->hold_depth;
+		raw_spin_unlock_irqrestore(&gate->lock, flags);
+		return;
+	}
+	__dl_gate_lock(gate);
 	raw_spin_unlock_irqrestore(&gate->lock, flags);
+
+	blackmagic_trace(BLACKMAGIC_TRACE_GATE_LOCK, current->pid, (unsigned long)gate);
 }
 
 bool dl_gate_lock_interrupt(struct blackmagic_gate *gate)
@@ -192,14 +450,18 @@ bool dl_gate_lock_interrupt(struct blackmagic_gate *gate)
 		gate->next = NULL;
 		locked = true;
 	}
+	if (locked)
+		gate_acquired(gate);
 	if (!locked)
 		gate->run_bh_on_unlock = true;
 	raw_spin_unlock_irqrestore(&gate->lock, flags);
 
+	blackmagic_trace(BLACKMAGIC_TRACE_GATE_LOCK_INTERRUPT, locked, (unsigned long)gate);
+
 	return locked;
 }
 
-static void __dl_gate_unlock(struct blackmagic_gate *gate)
+static void __dl_gate_run_deferred_bh(struct blackmagic_gate *gate)
 {
 	unsigned int status;
 
@@ -215,6 +477,24 @@ static void __dl_gate_unlock(struct blackmagic_gate *gate)
 		}
 		raw_spin_lock_irq(&gate->lock);
 	}
+}
+
+/* The gate changes hands, so any hold on it ends */
+static inline void gate_clear_holder(struct blackmagic_gate *gate)
+{
+	gate->holder = NULL;
+	gate->hold_depth = 0;
+}
+
+static void __dl_gate_unlock(struct blackmagic_gate *gate)
+{
+	gate_released(gate);
+	gate_clear_holder(gate);
+
+	if (gate->pi)
+		gate->owner = NULL;
+
+	__dl_gate_run_deferred_bh(gate);
 
 	if (likely(list_empty(&gate->wait_list)))
 	{
@@ -233,15 +513,127 @@ static void __dl_gate_unlock(struct blackmagic_gate *gate)
 void dl_gate_unlock(struct blackmagic_gate *gate)
 {
 	unsigned long flags;
+
 	raw_spin_lock_irqsave(&gate->lock, flags);
-		__dl_gate_unlock(gate);
+	if (gate_held_by_current(gate) && gate->hold_depth)
+	{
+		--gate->hold_depth;
+		raw_spin_unlock_irqrestore(&gate->lock, flags);
+		return;
+	}
+
+	blackmagic_trace(BLACKMAGIC_TRACE_GATE_UNLOCK, in_interrupt() ? 0 : current->pid, (unsigned long)gate);
+	__dl_gate_unlock(gate);
 	raw_spin_unlock_irqrestore(&gate->lock, flags);
+
+	gate_pi_unboost(gate);
 }
 
-static struct blackmagic_gate_event* get_event(struct blackmagic_gate* gate, void* event, bool create)
+/*
+ * Hold the gate across several support library calls. The holder's own
+ * dl_gate_lock and dl_gate_unlock calls nest inside the hold rather than
+ * releasing the gate, so a batch of commands costs one acquisition.
+ * dl_gate_sleep still releases the gate while the holder sleeps, and gives
+ * up the hold with it until the gate is taken again.
+ */
+void __sched dl_gate_hold(struct blackmagic_gate *gate)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&gate->lock, flags);
+	__dl_gate_lock(gate);
+	gate->holder = current;
+	gate->hold_depth = 0;
+	raw_spin_unlock_irqrestore(&gate->lock, flags);
+
+	blackmagic_trace(BLACKMAGIC_TRACE_GATE_LOCK, current->pid, (unsigned long)gate);
+}
+
+void dl_gate_release(struct blackmagic_gate *gate)
+{
+	unsigned long flags;
+	unsigned int depth = 0;
+
+	blackmagic_trace(BLACKMAGIC_TRACE_GATE_UNLOCK, current->pid, (unsigned long)gate);
+
+	raw_spin_lock_irqsave(&gate->lock, flags);
+	if (gate->holder == current)
+	{
+		depth = gate->hold_depth;
+		gate->holder = NULL;
+		gate->hold_depth = 0;
+	}
+	__dl_gate_unlock(gate);
+	raw_spin_unlock_irqrestore(&gate->lock, flags);
+
+	gate_pi_unboost(gate);
+
+	if (depth)
+		dl_warn("gate released with %u nested locks\n", depth);
+}
+
+/*
+ * Double the event hash table once there are more sleeping keys than buckets.
+ * Called by a sleeper before it takes gate->lock, so the table is allocated
+ * and the old one freed with interrupts on. Failure to allocate is harmless,
+ * the chains just get longer.
+ */
+static void grow_event_table(struct blackmagic_gate *gate)
+{
+	struct hlist_head *table, *old;
+	struct blackmagic_gate_event *ev;
+	struct hlist_node *tmp;
+	unsigned int bits = ACCESS_ONCE(gate->event_bits) + 1;
+	unsigned int i;
+
+	if (bits > EVENT_TABLE_MAX_BITS)
+		return;
+
+	table = alloc_event_table(bits, GFP_KERNEL);
+	if (!table)
+		return;
+
+	raw_spin_lock_irq(&gate->lock);
+
+	// Another sleeper got there first
+	if (gate->event_bits + 1 != bits)
+	{
+		old = table;
+		goto out;
+	}
+
+	for (i = 0; i < (1U << gate->event_bits); ++i)
+	{
+		while (!hlist_empty(&gate->events[i]))
+		{
+			tmp = gate->events[i].first;
+			ev = hlist_entry(tmp, struct blackmagic_gate_event, list);
+			hlist_del(tmp);
+			hlist_add_head(tmp, &table[hash_ptr(ev->event, bits)]);
+		}
+	}
+
+	old = gate->events;
+	gate->events = table;
+	gate->event_bits = bits;
+	++gate->stats.table_resizes;
+
+out:
+	raw_spin_unlock_irq(&gate->lock);
+	kfree(old);
+}
+
+/*
+ * Find the event for a key, or with create set make one from the pool or
+ * from *spare. Returns NULL if both are empty; the caller allocates a spare
+ * outside the lock and tries again.
+ */
+static struct blackmagic_gate_event* get_event(struct blackmagic_gate* gate, void* event, bool create,
+	struct blackmagic_gate_event **spare)
 {
 	struct blackmagic_gate_event* ev;
-	unsigned idx = hash_ptr(event, EVENT_TABLE_BITS);
+	unsigned idx = hash_ptr(event, gate->event_bits);
+	bool pooled = true;
 
 	hlist_for_each_entry(ev, &gate->events[idx], list)
 	{
@@ -254,16 +646,34 @@ static struct blackmagic_gate_event* get_event(struct blackmagic_gate* gate, voi
 
 	if (create)
 	{
-		ev = kmalloc(sizeof(struct blackmagic_gate_event), GFP_ATOMIC);
-		if (!ev)
+		if (likely(!hlist_empty(&gate->free_events)))
+		{
+			ev = hlist_entry(gate->free_events.first, struct blackmagic_gate_event, list);
+			hlist_del(&ev->list);
+		}
+		else if (spare && *spare)
+		{
+			ev = *spare;
+			*spare = NULL;
+			pooled = false;
+		}
+		else
+		{
+			if (!spare)
+				++gate->stats.pool_exhausted;
 			return NULL;
+		}
 
 		*ev = (struct blackmagic_gate_event) {
 			.list = { NULL, NULL },
 			.wqh = __WAIT_QUEUE_HEAD_INITIALIZER(ev->wqh),
 			.ref = 1,
-			.event = event
+			.event = event,
+			.pooled = pooled
 		};
+
+		if (++gate->active_events > gate->stats.max_active)
+			gate->stats.max_active = gate->active_events;
 		hlist_add_head(&ev->list, &gate->events[idx]);
 	}
 	else
@@ -275,35 +685,61 @@ done:
 	return ev;
 }
 
-static void put_event(struct blackmagic_gate_event* event)
+static void put_event(struct blackmagic_gate* gate, struct blackmagic_gate_event* event)
 {
 	if (--event->ref == 0)
 	{
 		hlist_del(&event->list);
-		kfree(event);
+		--gate->active_events;
+		hlist_add_head(&event->list, &gate->free_events);
 	}
 }
 
-int dl_gate_sleep(struct blackmagic_gate *gate, void* key)
+static int __dl_gate_sleep(struct blackmagic_gate *gate, void* key, long timeout)
 {
-	int result = 0;
+	int result = THREAD_AWAKENED;
 	struct blackmagic_gate_event* event = NULL;
 	struct blackmagic_gate_event_waiter waiter;
+	struct blackmagic_gate_event* spare = NULL;
+	struct task_struct *holder = NULL;
+	unsigned int hold_depth = 0;
+	bool unboost = true;
 
 	init_wait(&waiter.wait);
 	waiter.triggered = false;
+	waiter.owns_gate = false;
+
+	if (ACCESS_ONCE(gate->active_events) >= (1U << ACCESS_ONCE(gate->event_bits)))
+		grow_event_table(gate);
 
 	raw_spin_lock_irq(&gate->lock);
 
-	// Ensure we have an event in the list
-	event = get_event(gate, key, true);
+	// Ensure we have an event in the list, allocating one if the pool is empty
+	event = get_event(gate, key, true, NULL);
 	if (!event)
 	{
-		result = -ENOMEM;
-		goto bail;
+		raw_spin_unlock_irq(&gate->lock);
+		spare = kmalloc(sizeof(struct blackmagic_gate_event), GFP_KERNEL);
+		raw_spin_lock_irq(&gate->lock);
+
+		event = get_event(gate, key, true, &spare);
+		if (!event)
+		{
+			++gate->stats.alloc_failures;
+			result = THREAD_INTERRUPTED;
+			goto bail;
+		}
 	}
 
-	// Release the gate
+	// Release the gate, and any hold on it, until we have it back
+	if (gate_held_by_current(gate))
+	{
+		holder = gate->holder;
+		hold_depth = gate->hold_depth;
+		gate->holder = NULL;
+		gate->hold_depth = 0;
+	}
+	blackmagic_trace(BLACKMAGIC_TRACE_GATE_UNLOCK, current->pid, (unsigned long)gate);
 	__dl_gate_unlock(gate);
 
 	spin_lock(&event->wqh.lock);
@@ -319,19 +755,29 @@ int dl_gate_sleep(struct blackmagic_gate *gate, void* key)
 		if (waiter.triggered)
 			break;
 
-		if (!signal_pending(current))
+		if (signal_pending(current))
 		{
-			spin_unlock(&event->wqh.lock);
-			raw_spin_unlock_irq(&gate->lock);
-			schedule();
-			raw_spin_lock_irq(&gate->lock);
-			spin_lock(&event->wqh.lock);
-			continue;
+			result = THREAD_INTERRUPTED;
+			break;
 		}
 
-		result = -ERESTARTSYS;
+		if (timeout <= 0)
+		{
+			result = THREAD_TIMED_OUT;
+			break;
+		}
 
-		break;
+		spin_unlock(&event->wqh.lock);
+		raw_spin_unlock_irq(&gate->lock);
+		// The gate is let go while we sleep, so give up any boost first
+		if (unboost)
+		{
+			gate_pi_unboost(gate);
+			unboost = false;
+		}
+		timeout = schedule_timeout(timeout);
+		raw_spin_lock_irq(&gate->lock);
+		spin_lock(&event->wqh.lock);
 	}
 	__remove_wait_queue(&event->wqh, &waiter.wait);
 	__set_current_state(TASK_RUNNING);
@@ -339,17 +785,41 @@ int dl_gate_sleep(struct blackmagic_gate *gate, void* key)
 	spin_unlock(&event->wqh.lock);
 
 	// Clean up the event
-	put_event(event);
+	put_event(gate, event);
 
-	// Acquire the gate
-	__dl_gate_lock(gate);
+	// Acquire the gate, unless it was handed to us by the waker
+	if (!waiter.owns_gate)
+		__dl_gate_lock(gate);
+	else
+		gate_acquired(gate);
+	gate->holder = holder;
+	gate->hold_depth = hold_depth;
+	blackmagic_trace(BLACKMAGIC_TRACE_GATE_LOCK, current->pid, (unsigned long)gate);
 
 bail:
 	raw_spin_unlock_irq(&gate->lock);
 
-	return result != 0 ? THREAD_INTERRUPTED : THREAD_AWAKENED;
+	// Not needed after all if the pool was refilled in the meantime
+	kfree(spare);
+
+	return result;
 }
 
+int dl_gate_sleep(struct blackmagic_gate *gate, void* key)
+{
+	return __dl_gate_sleep(gate, key, MAX_SCHEDULE_TIMEOUT);
+}
+
+/*
+ * Like dl_gate_sleep, but gives up after timeout_ms milliseconds and returns
+ * THREAD_TIMED_OUT. The gate is held again on return in every case.
+ */
+int dl_gate_sleep_timeout(struct blackmagic_gate *gate, void* key, unsigned long timeout_ms)
+{
+	return __dl_gate_sleep(gate, key, msecs_to_jiffies(timeout_ms));
+}
+
+/* Wake the first sleeper on key that was not already running */
 void dl_gate_wakeup(struct blackmagic_gate *gate, void* key)
 {
 	struct blackmagic_gate_event* event = NULL;
@@ -357,7 +827,7 @@ void dl_gate_wakeup(struct blackmagic_gate *gate, void* key)
 	unsigned long flags;
 
 	raw_spin_lock_irqsave(&gate->lock, flags);
-	event = get_event(gate, key, false);
+	event = get_event(gate, key, false, NULL);
 	raw_spin_unlock_irqrestore(&gate->lock, flags);
 
 	if (!event)
@@ -377,6 +847,71 @@ void dl_gate_wakeup(struct blackmagic_gate *gate, void* key)
 	spin_unlock_irqrestore(&event->wqh.lock, flags);
 
 	raw_spin_lock_irqsave(&gate->lock, flags);
-	put_event(event);
+	put_event(gate, event);
 	raw_spin_unlock_irqrestore(&gate->lock, flags);
 }
+
+/*
+ * Release the gate and wake the longest waiting sleeper on key, handing the
+ * gate straight to it so it does not have to contend for it again. If nobody
+ * sleeps on key the gate is released as by dl_gate_unlock. Must be called
+ * with the gate held. Returns true if a sleeper was woken.
+ */
+bool dl_gate_unlock_and_wakeup_one(struct blackmagic_gate *gate, void* key)
+{
+	struct blackmagic_gate_event* event = NULL;
+	struct blackmagic_gate_event_waiter* waiter = NULL;
+	wait_queue_t* curr;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&gate->lock, flags);
+
+	// Inside a hold the gate stays with the holder, so just wake a sleeper
+	if (gate_held_by_current(gate) && gate->hold_depth)
+	{
+		--gate->hold_depth;
+		raw_spin_unlock_irqrestore(&gate->lock, flags);
+		dl_gate_wakeup(gate, key);
+		return false;
+	}
+
+	__dl_gate_run_deferred_bh(gate);
+
+	event = get_event(gate, key, false, NULL);
+	if (event)
+	{
+		spin_lock(&event->wqh.lock);
+		list_for_each_entry(curr, &event->wqh.task_list, task_list)
+		{
+			waiter = container_of(curr, struct blackmagic_gate_event_waiter, wait);
+			if (!waiter->triggered)
+				break;
+			waiter = NULL;
+		}
+
+		if (waiter)
+		{
+			gate_released(gate);
+			gate_clear_holder(gate);
+			if (gate->pi)
+				gate->owner = waiter->wait.private;
+			waiter->triggered = true;
+			waiter->owns_gate = true;
+			blackmagic_trace(BLACKMAGIC_TRACE_GATE_HANDOFF,
+				((struct task_struct *)waiter->wait.private)->pid, (unsigned long)gate);
+			curr->func(curr, TASK_NORMAL, 0, NULL);
+		}
+		spin_unlock(&event->wqh.lock);
+
+		put_event(gate, event);
+	}
+
+	if (!waiter)
+		__dl_gate_unlock(gate);
+
+	raw_spin_unlock_irqrestore(&gate->lock, flags);
+
+	gate_pi_unboost(gate);
+
+	return waiter != NULL;
+}
@@ -31,16 +31,33 @@
 
 struct blackmagic_gate;
 
+struct blackmagic_gate_stats
+{
+	unsigned long pool_size;		/* Preallocated sleep events */
+	unsigned long pool_exhausted;	/* Sleeps that had to allocate an extra event */
+	unsigned long alloc_failures;	/* Sleeps that failed with -ENOMEM */
+	unsigned long max_active;		/* Peak number of keys slept on at once */
+	unsigned long table_resizes;
+	unsigned long holds;			/* Times the gate was acquired */
+	unsigned long long hold_time;	/* Total time held, ns */
+	unsigned long long max_hold;	/* Longest hold, ns */
+};
+
 struct blackmagic_gate *dl_alloc_gate();
 void dl_free_gate(struct blackmagic_gate *gate);
 void dl_gate_set_device(struct blackmagic_gate *gate, void *dev);
+void dl_gate_get_stats(struct blackmagic_gate *gate, struct blackmagic_gate_stats *stats);
 
 void dl_gate_lock(struct blackmagic_gate *gate);
 bool dl_gate_lock_interrupt(struct blackmagic_gate *gate);
 void dl_gate_unlock(struct blackmagic_gate *gate);
+void dl_gate_hold(struct blackmagic_gate *gate);
+void dl_gate_release(struct blackmagic_gate *gate);
 
 int dl_gate_sleep(struct blackmagic_gate *gate, void* key);
-void dl_gate_wakeup(struct blackmagic_gate *gate);
+int dl_gate_sleep_timeout(struct blackmagic_gate *gate, void* key, unsigned long timeout_ms);
+void dl_gate_wakeup(struct blackmagic_gate *gate, void* key);
+bool dl_gate_unlock_and_wakeup_one(struct blackmagic_gate *gate, void* key);
 
 
 #endif
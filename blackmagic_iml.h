@@ -40,6 +40,21 @@ enum {
 
 /* Init and Startup */
 extern int blackmagic_ioctl_private(void *, void *, unsigned int, unsigned long);
+
+/*
+ * Command numbers blackmagic_ioctl_private dispatches on. The library ships
+ * no header for them; these are the ones the shim itself looks at.
+ */
+enum {
+	DL_CMD_VIDEO_OUTPUT_ON					= 0x903,
+	DL_CMD_VIDEO_OUTPUT_OFF					= 0x904,
+	DL_CMD_GET_COMPLETED_PLAYBACK_FRAMES	= 0x90a,
+	DL_CMD_VIDEO_INPUT_ON					= 0x910,
+	DL_CMD_VIDEO_INPUT_OFF					= 0x911,
+	DL_CMD_GET_COMPLETED_INPUT_FRAME		= 0x916,
+	DL_CMD_RECYCLE_COMPLETED_INPUT_FRAMES	= 0x918,
+};
+
 extern void *dl_alloc_driver(void);
 extern int dl_start_driver(void *, void *, void *, unsigned int* flags);
 extern void *dl_create_and_init_user_client(void *, void *);
@@ -68,6 +83,7 @@ extern void blackmagic_serial_clear_rx_buffer(void *);
 extern int blackmagic_serial_open_ioctl(void *);
 extern int blackmagic_serial_close_ioctl(void *);
 extern int blackmagic_serial_dequeue_data(void *, unsigned char *, int);
+extern int blackmagic_serial_dequeue_data_stamped(void *, unsigned char *, int, struct blackmagic_serial_stamp *);
 extern int blackmagic_serial_enqueue_data(void *, const unsigned char *, int);
 extern int blackmagic_serial_port_is_in_use(void *);
 extern int blackmagic_serial_port_path(void *, char*, int);
@@ -77,6 +93,19 @@ extern unsigned int dl_interrupt_handler(void *data);
 extern unsigned int dl_tasklet_handler(void *data);
 extern unsigned int dl_tasklet_handler_gated(void *data);
 extern void dl_bh_work_handler(void *data);
+extern void blackmagic_field_interrupt(void *, unsigned int);
+
+/* Shared audio rings */
+enum {
+	BLACKMAGIC_AUDIO_INPUT = 0,
+	BLACKMAGIC_AUDIO_OUTPUT,
+	BLACKMAGIC_AUDIO_DIRECTIONS,
+};
+
+extern void blackmagic_audio_buffer_register(void *, int direction, void *buffer,
+	unsigned long size, unsigned int frame_bytes, unsigned int sample_rate);
+extern void blackmagic_audio_buffer_unregister(void *, int direction);
+extern void blackmagic_audio_position(void *, int direction, unsigned int position, unsigned int wrap_count);
 
 extern bool dl_pci_start(void *pci_dev);
 extern void dl_pci_stop(void *pci_dev);
@@ -0,0 +1,348 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+#ifndef BLACKMAGIC_IOCTL_H
+#define BLACKMAGIC_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * IOCTLs handled by this driver directly rather than by the support library.
+ * The library uses plain command numbers, so these never collide with it.
+ * Pointers are passed as __u64 so 32-bit clients use the same layout.
+ */
+#define BLACKMAGIC_IOC_MAGIC				'B'
+
+#define BLACKMAGIC_WAIT_FOREVER				0xffffffffU
+
+/*
+ * Serial port in IOCTL mode. The port belongs to the file whose support
+ * library call opened it; other files get -EBADF.
+ */
+struct blackmagic_serial_io
+{
+	__u64	data;			/* User buffer */
+	__u32	count;			/* Bytes to read or write */
+	__u32	timeout_ms;		/* 0 to not wait, BLACKMAGIC_WAIT_FOREVER to wait indefinitely */
+};
+
+/* When and in which video field a batch of serial bytes was received */
+struct blackmagic_serial_stamp
+{
+	__u64	timestamp;		/* Monotonic ns, 0 if unknown */
+	__u32	field;			/* Hardware field count */
+	__u32	field_offset;	/* ns since the start of that field */
+};
+
+struct blackmagic_serial_stamped_io
+{
+	struct blackmagic_serial_io io;
+	struct blackmagic_serial_stamp stamp;	/* Out: stamp of the returned bytes */
+};
+
+/* Return the number of bytes transferred, or -ETIMEDOUT if none were */
+#define BLACKMAGIC_IOC_SERIAL_READ			_IOW(BLACKMAGIC_IOC_MAGIC, 0x01, struct blackmagic_serial_io)
+#define BLACKMAGIC_IOC_SERIAL_WRITE			_IOW(BLACKMAGIC_IOC_MAGIC, 0x02, struct blackmagic_serial_io)
+/* As SERIAL_READ, but never returns bytes from more than one received batch */
+#define BLACKMAGIC_IOC_SERIAL_READ_STAMPED	_IOWR(BLACKMAGIC_IOC_MAGIC, 0x03, struct blackmagic_serial_stamped_io)
+
+/*
+ * Wait for video frame events (POLLIN for input, POLLOUT for output) without
+ * a poll() round trip. With busy_poll_us set, the driver first spins on the
+ * completion state for up to that long (capped by blackmagic_busy_poll_max_us)
+ * before sleeping.
+ */
+struct blackmagic_wait
+{
+	__u32	events;			/* POLLIN and/or POLLOUT */
+	__u32	revents;		/* Out: events that are ready */
+	__u32	timeout_ms;		/* 0 to not sleep, BLACKMAGIC_WAIT_FOREVER to sleep indefinitely */
+	__u32	busy_poll_us;	/* 0 to sleep straight away */
+};
+
+/* Returns 0 with revents set, or -ETIMEDOUT */
+#define BLACKMAGIC_IOC_WAIT					_IOWR(BLACKMAGIC_IOC_MAGIC, 0x04, struct blackmagic_wait)
+
+/*
+ * Event sequence numbers. Every input or output event advances a counter, so
+ * coalesced events can be counted. In edge mode, POLLIN and POLLOUT report
+ * that the counter advanced since the last BLACKMAGIC_IOC_EVENT_SEQ, which
+ * suits EPOLLET and draining in batches.
+ */
+#define BLACKMAGIC_EVENT_EDGE				0x00000001
+
+struct blackmagic_event_seq
+{
+	__u32	input_seq;		/* Input event sequence number */
+	__u32	output_seq;		/* Output event sequence number */
+	__u32	input_events;	/* Input events since the previous read */
+	__u32	output_events;	/* Output events since the previous read */
+};
+
+/* Takes BLACKMAGIC_EVENT_* flags; the mode lasts until the file is closed */
+#define BLACKMAGIC_IOC_EVENT_MODE			_IOW(BLACKMAGIC_IOC_MAGIC, 0x05, __u32)
+/* Needs edge mode; reading marks the events seen */
+#define BLACKMAGIC_IOC_EVENT_SEQ			_IOR(BLACKMAGIC_IOC_MAGIC, 0x06, struct blackmagic_event_seq)
+
+/*
+ * Bind an eventfd to notification classes. The driver adds one to the
+ * eventfd per event, so one epoll loop can serve many cards. A negative fd
+ * or empty class mask removes the binding. Only input and output events can
+ * be bound for now; asking for audio or notification events fails with
+ * EOPNOTSUPP.
+ */
+#define BLACKMAGIC_EVENTFD_INPUT			0x00000002	/* Input frame arrived */
+#define BLACKMAGIC_EVENTFD_OUTPUT			0x00000004	/* Output frame completed */
+#define BLACKMAGIC_EVENTFD_AUDIO			0x00000008	/* Audio interrupt */
+#define BLACKMAGIC_EVENTFD_NOTIFICATION		0x00000010	/* API notification */
+
+struct blackmagic_eventfd_bind
+{
+	__s32	fd;
+	__u32	classes;		/* BLACKMAGIC_EVENTFD_* */
+};
+
+#define BLACKMAGIC_IOC_EVENTFD_BIND			_IOW(BLACKMAGIC_IOC_MAGIC, 0x07, struct blackmagic_eventfd_bind)
+
+/*
+ * Sony 9-pin (RS-422) deck control engine. Commands are queued in the
+ * driver, sent at a fixed offset from the video field interrupt, and
+ * completed with the deck's response stamped with the field it arrived in.
+ * Messages are CMD1 CMD2 DATA...; the driver appends and checks checksums.
+ *
+ * The field interrupt comes from the support library, and the current
+ * library does not report it yet. Until it does, the field counts read 0,
+ * offset_us is ignored and commands are sent as soon as they are queued.
+ * Loopback mode runs its own simulated 59.94 Hz field clock.
+ */
+#define BLACKMAGIC_DECK_MAX_MSG				24
+
+#define BLACKMAGIC_DECK_LOOPBACK			0x00000001	/* Answer from a simulated deck, do not use the port */
+
+struct blackmagic_deck_config
+{
+	__u32	offset_us;		/* Transmit offset from the start of the field */
+	__u32	timeout_ms;		/* Response timeout, 0 for the default */
+	__u32	flags;
+	__u32	reserved;
+};
+
+struct blackmagic_deck_command
+{
+	__u64	tag;			/* Returned in the completion */
+	__u32	length;			/* Bytes used in data, without checksum */
+	__u32	reserved;
+	__u8	data[BLACKMAGIC_DECK_MAX_MSG];
+};
+
+struct blackmagic_deck_completion
+{
+	__u64	tag;
+	__s32	status;			/* 0, -ETIMEDOUT, -EIO on bad checksum, -ECANCELED */
+	__u32	length;			/* Response bytes in data, without checksum */
+	__u64	sent_time;		/* Monotonic ns */
+	__u64	response_time;	/* Monotonic ns */
+	__u32	sent_field;		/* Field count when the command was sent */
+	__u32	response_field;	/* Field count when the response arrived */
+	__u8	data[BLACKMAGIC_DECK_MAX_MSG];
+};
+
+struct blackmagic_deck_wait
+{
+	__u64	completions;	/* User array of struct blackmagic_deck_completion */
+	__u32	count;
+	__u32	timeout_ms;
+};
+
+#define BLACKMAGIC_IOC_DECK_OPEN			_IOW(BLACKMAGIC_IOC_MAGIC, 0x10, struct blackmagic_deck_config)
+#define BLACKMAGIC_IOC_DECK_CLOSE			_IO(BLACKMAGIC_IOC_MAGIC, 0x11)
+/* Returns -EAGAIN when the command queue is full */
+#define BLACKMAGIC_IOC_DECK_SUBMIT			_IOW(BLACKMAGIC_IOC_MAGIC, 0x12, struct blackmagic_deck_command)
+/* Returns the number of completions copied, or -ETIMEDOUT if none were */
+#define BLACKMAGIC_IOC_DECK_COMPLETE		_IOW(BLACKMAGIC_IOC_MAGIC, 0x13, struct blackmagic_deck_wait)
+
+/*
+ * Shared audio capture status. mmap one read-only page at this offset to
+ * follow the hardware write pointer without a system call; the samples
+ * themselves are still read with the audio input commands. The page is updated under a sequence count: read seq, skip
+ * while odd, read the fields, and retry if seq changed.
+ *
+ * The pages are fed by hooks in the support library. Until a library that
+ * calls them has started audio on the device, mmap fails with ENODEV.
+ */
+#define BLACKMAGIC_MMAP_AUDIO_INPUT_STATUS	0x40000000UL
+
+struct blackmagic_audio_status
+{
+	__u32	seq;				/* Odd while the driver is updating */
+	__u32	buffer_size;		/* Bytes, 0 while audio is stopped */
+	__u32	frame_bytes;		/* Bytes per sample frame, all channels */
+	__u32	sample_rate;
+	__u32	position;			/* Hardware write pointer, bytes into the buffer */
+	__u32	wrap_count;			/* Times the hardware has wrapped the buffer */
+	__u64	timestamp;			/* Uptime of the position update, ns */
+};
+
+/*
+ * Run up to BLACKMAGIC_BATCH_MAX support library commands in one call, under
+ * a single hold of the command gate, e.g. to drain every completed input or
+ * playback frame after a scheduling delay. Each entry is a command and
+ * argument as they would be passed to ioctl(); its return value is stored in
+ * result. Without BLACKMAGIC_BATCH_STOP_ON_ERROR every entry is run.
+ *
+ * Only the commands that dequeue completed input or playback frames and
+ * recycle completed input frames may be batched; any other command fails the
+ * whole batch with EPERM before anything is run.
+ */
+#define BLACKMAGIC_BATCH_MAX				64
+#define BLACKMAGIC_BATCH_STOP_ON_ERROR		0x00000001
+
+struct blackmagic_batch_entry
+{
+	__u32	cmd;
+	__s32	result;
+	__u64	arg;
+};
+
+struct blackmagic_batch
+{
+	__u64	entries;		/* struct blackmagic_batch_entry[count] */
+	__u32	count;
+	__u32	flags;			/* BLACKMAGIC_BATCH_* */
+	__u32	completed;		/* Entries run, returned */
+	__u32	reserved;
+};
+
+#define BLACKMAGIC_IOC_BATCH				_IOWR(BLACKMAGIC_IOC_MAGIC, 0x09, struct blackmagic_batch)
+
+/*
+ * Keep a user buffer pinned and DMA mapped until it is unpinned or the file
+ * is closed. Frames scheduled or provided from inside it are then neither
+ * pinned nor mapped while the support library holds the command gate.
+ * BLACKMAGIC_PIN_UNPIN drops the region starting at addr, or all of them if
+ * addr is 0. Pinned pages count against RLIMIT_MEMLOCK like mlock'd ones;
+ * past the limit, without CAP_IPC_LOCK, pinning fails with ENOMEM.
+ */
+#define BLACKMAGIC_PIN_WRITE				0x00000001	/* Device writes to the buffer */
+#define BLACKMAGIC_PIN_UNPIN				0x00000002
+
+struct blackmagic_pin
+{
+	__u64	addr;
+	__u64	len;
+	__u32	flags;			/* BLACKMAGIC_PIN_* */
+	__u32	reserved;
+};
+
+#define BLACKMAGIC_IOC_PIN					_IOW(BLACKMAGIC_IOC_MAGIC, 0x0a, struct blackmagic_pin)
+
+/*
+ * Capture fan-out. The client that captures an input becomes the publisher
+ * and publishes each completed frame; every subscribed client receives a
+ * record and maps the frame read-only at record.mmap_offset. A frame comes
+ * back to the publisher through BLACKMAGIC_IOC_FANOUT_RECLAIM, as its
+ * cookie, once every subscriber has released it, and can then be recycled.
+ * Records and reclaimed cookies are reported by poll as POLLPRI.
+ *
+ * Published frames must live in a MAP_SHARED mapping of a file, e.g. a memfd
+ * or a file in /dev/shm. Anonymous and copied-on-write pages cannot be mapped
+ * into other processes, and PUBLISH fails with EINVAL if the frame uses any.
+ */
+#define BLACKMAGIC_FANOUT_SLOTS				16			/* Frames published and not yet reclaimed */
+#define BLACKMAGIC_MMAP_FANOUT_BASE			0x100000000ULL
+#define BLACKMAGIC_MMAP_FANOUT_SPAN			0x10000000ULL	/* Per frame slot */
+
+struct blackmagic_fanout_publish
+{
+	__u64	addr;			/* Frame in the publisher's memory */
+	__u64	length;
+	__u64	cookie;			/* Returned by RECLAIM, e.g. the frame's buffer index */
+	__u64	timestamp;		/* Passed through to subscribers */
+	__u64	seq;			/* Returned */
+};
+
+struct blackmagic_fanout_record
+{
+	__u64	seq;
+	__u64	cookie;
+	__u64	timestamp;
+	__u64	mmap_offset;	/* Map the frame here, read-only */
+	__u64	length;
+	__u32	page_offset;	/* Start of the frame in the mapping */
+	__u32	reserved;
+};
+
+/* Returns the number of records or cookies copied, or -ETIMEDOUT if none were */
+struct blackmagic_fanout_wait
+{
+	__u64	records;		/* blackmagic_fanout_record[count], or __u64 cookies[count] for RECLAIM */
+	__u32	count;
+	__u32	timeout_ms;
+};
+
+/* Non-zero starts publishing or subscribing, zero stops */
+#define BLACKMAGIC_IOC_FANOUT_PUBLISHER		_IOW(BLACKMAGIC_IOC_MAGIC, 0x0b, __u32)
+#define BLACKMAGIC_IOC_FANOUT_PUBLISH		_IOWR(BLACKMAGIC_IOC_MAGIC, 0x0c, struct blackmagic_fanout_publish)
+#define BLACKMAGIC_IOC_FANOUT_RECLAIM		_IOW(BLACKMAGIC_IOC_MAGIC, 0x0d, struct blackmagic_fanout_wait)
+#define BLACKMAGIC_IOC_FANOUT_SUBSCRIBE		_IOW(BLACKMAGIC_IOC_MAGIC, 0x0e, __u32)
+#define BLACKMAGIC_IOC_FANOUT_READ			_IOW(BLACKMAGIC_IOC_MAGIC, 0x0f, struct blackmagic_fanout_wait)
+/* Takes the record's seq */
+#define BLACKMAGIC_IOC_FANOUT_RELEASE		_IOW(BLACKMAGIC_IOC_MAGIC, 0x14, __u64)
+
+/*
+ * Capture-to-file sink. The driver subscribes to the device's fan-out on
+ * behalf of fd and writes each published frame to it at increasing offsets,
+ * from a kernel thread, then releases the frame. Userspace only collects the
+ * completion records. fd should be opened O_DIRECT, in which case frame
+ * lengths and the start offset must suit the file's block size.
+ */
+struct blackmagic_capture_sink
+{
+	__s32	fd;
+	__u32	reserved;
+	__u64	offset;			/* File offset of the first frame */
+};
+
+struct blackmagic_capture_completion
+{
+	__u64	seq;			/* Fan-out sequence number */
+	__u64	cookie;
+	__u64	timestamp;
+	__u64	file_offset;
+	__u64	length;			/* Bytes written */
+	__s32	status;			/* 0 or a negative errno */
+	__u32	write_us;		/* Time spent in the write */
+};
+
+#define BLACKMAGIC_IOC_CAPTURE_SINK_START	_IOW(BLACKMAGIC_IOC_MAGIC, 0x15, struct blackmagic_capture_sink)
+#define BLACKMAGIC_IOC_CAPTURE_SINK_STOP	_IO(BLACKMAGIC_IOC_MAGIC, 0x16)
+/* Takes blackmagic_capture_completion records; returns the count or -ETIMEDOUT */
+#define BLACKMAGIC_IOC_CAPTURE_SINK_COMPLETE	_IOW(BLACKMAGIC_IOC_MAGIC, 0x17, struct blackmagic_fanout_wait)
+
+#endif
@@ -43,10 +43,19 @@
 #include <linux/fcntl.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	#include <linux/sched/mm.h>
+	#include <linux/sched/signal.h>
+#endif
+#include <linux/capability.h>
 #include <linux/slab.h>
 #include <linux/time.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/workqueue.h>
 #include <linux/jhash.h>
 #include <asm/page.h>
 #include <asm/div64.h>
@@ -85,20 +94,100 @@ const char *DL_KERN_ERR = KERN_ERR;
 
 static struct kmem_cache *__dl_wait_queue_cache = NULL;
 
+/*
+ * Waiters are pollers and the library's own waits on wqh, all non-exclusive:
+ * a poller's table spans several queues and events, so handing an event to
+ * one of them could give it to a thread that is not interested in it.
+ */
 struct dl_wait_queue_head_t
 {
-	struct list_head entry;
+	struct list_head entry;			/* On __dl_wait_queues */
 	wait_queue_head_t wqh;
 	atomic_t state;
-	atomic_t sleepers;
+	atomic_t seq;					/* Events set since allocation */
+	atomic_long_t wakeups;			/* Events that woke someone */
+	atomic_long_t skipped;			/* Events with nobody waiting */
+	int event_class;				/* DL_EVENT_CLASS_*, set by the library or learned from polls */
+	struct list_head bindings;		/* dl_event_binding_link, protected by __dl_event_bindings_lock */
 	void *private_data;
 };
 
+/* Every allocated queue, and totals across all of them, for /proc/driver/blackmagic/stats */
+static LIST_HEAD(__dl_wait_queues);
+static DEFINE_SPINLOCK(__dl_wait_queues_lock);
+static atomic_long_t __dl_wait_queue_wakeups = ATOMIC_LONG_INIT(0);
+static atomic_long_t __dl_wait_queue_skipped = ATOMIC_LONG_INIT(0);
+
+/*
+ * Edge-triggered event cursors, one per file that opted in. Queue pointers
+ * are only compared, never dereferenced, so a cursor can outlive a queue.
+ */
+struct dl_event_cursor
+{
+	struct list_head entry;
+	void *filp;
+	struct {
+		void *queue;				/* Last queue polled in this direction */
+		unsigned int seq;			/* Its sequence number at that poll */
+		unsigned int seen;			/* Sequence number last returned by dl_event_cursor_read */
+	} dir[2];						/* Indexed by dl_poll_wait's write flag */
+};
+
+/*
+ * eventfd bindings, one per user client. The eventfd is written from a work
+ * item since eventfd_signal is GPL-only and a write can't be done from the
+ * bottom half. Clients may share queues, so a queue keeps a list of links,
+ * one for each binding it is attached to.
+ */
+#define DL_EVENT_BINDING_QUEUES		8
+
+struct dl_event_binding;
+
+struct dl_event_binding_link
+{
+	struct list_head entry;			/* On the queue's bindings */
+	struct dl_event_binding *binding;
+	struct dl_wait_queue_head_t *queue;
+};
+
+struct dl_event_binding
+{
+	struct list_head entry;
+	void *client;
+	struct file *eventfd;
+	unsigned int classes;			/* 1 << DL_EVENT_CLASS_* */
+	atomic_t pending;				/* Events not yet written to the eventfd */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+	struct delayed_work work;
+#else
+	struct work_struct work;
+#endif
+	struct dl_event_binding_link links[DL_EVENT_BINDING_QUEUES];
+	unsigned int nr_queues;
+};
+
+static LIST_HEAD(__dl_event_bindings);
+static DEFINE_SPINLOCK(__dl_event_bindings_lock);
+static atomic_t __dl_event_binding_count = ATOMIC_INIT(0);
+
+static void dl_event_signal(struct dl_wait_queue_head_t *queue);
+
+static LIST_HEAD(__dl_event_cursors);
+static DEFINE_SPINLOCK(__dl_event_cursors_lock);
+static atomic_t __dl_event_cursor_count = ATOMIC_INIT(0);
+
 struct dl_spinlock_t
 {
 	spinlock_t lock;
 };
 
+struct dl_snapshot_t
+{
+	seqlock_t lock;
+	unsigned int size;
+	unsigned char data[0];
+};
+
 inline int dl_flush_cache_all(void)
 {
 	return 0;
@@ -563,6 +652,60 @@ dl_sema_free(void *ptr)
 	kfree(ptr);
 }
 
+struct dl_snapshot_t *dl_alloc_snapshot(unsigned int size)
+{
+	struct dl_snapshot_t *snap;
+
+	snap = (struct dl_snapshot_t *)dl_kzalloc(sizeof(struct dl_snapshot_t) + size);
+	if (!snap)
+		return NULL;
+
+	seqlock_init(&snap->lock);
+	snap->size = size;
+	return snap;
+}
+
+void dl_free_snapshot(struct dl_snapshot_t *snap)
+{
+	dl_kfree(snap);
+}
+
+/*
+ * Publish part of a snapshot. Writers may run in the bottom half or from a
+ * setter holding the gate, so the sequence is bumped under the seqlock with
+ * interrupts disabled. Returns -EINVAL if the range is outside the snapshot.
+ */
+int dl_snapshot_publish(struct dl_snapshot_t *snap, unsigned int offset, const void *src, unsigned int size)
+{
+	unsigned long flags;
+
+	if (offset > snap->size || size > snap->size - offset)
+		return -EINVAL;
+
+	write_seqlock_irqsave(&snap->lock, flags);
+	memcpy(snap->data + offset, src, size);
+	write_sequnlock_irqrestore(&snap->lock, flags);
+	return 0;
+}
+
+/*
+ * Copy a consistent view of part of a snapshot without taking any lock,
+ * retrying if a writer raced with the copy.
+ */
+int dl_snapshot_read(struct dl_snapshot_t *snap, unsigned int offset, void *dst, unsigned int size)
+{
+	unsigned int seq;
+
+	if (offset > snap->size || size > snap->size - offset)
+		return -EINVAL;
+
+	do {
+		seq = read_seqbegin(&snap->lock);
+		memcpy(dst, snap->data + offset, size);
+	} while (read_seqretry(&snap->lock, seq));
+	return 0;
+}
+
 struct dl_thread_wrapper_struct
 {
 	thread_continue_t func;
@@ -646,46 +789,405 @@ dl_get_current()
 	return current;
 }
 
-void *
-dl_get_user_pages(void *task_ptr, void *ptr, unsigned long size, unsigned long *nr_pages, int write)
+static struct page **
+__dl_get_user_pages(struct task_struct *current_task, void *ptr, unsigned long nr_pages, int write)
 {
 	int ret;
-	struct task_struct *current_task = task_ptr;
 	struct page **pages;
-	unsigned long first, last;
-	
-	if (!current_task)
-		return NULL;
-
-	first = ((unsigned long)ptr) >> PAGE_SHIFT;
-	last = ((unsigned long)ptr + size - 1) >> PAGE_SHIFT;
-	*nr_pages = last - first + 1;
 
-	pages = kmalloc(*nr_pages * sizeof(struct page *), GFP_KERNEL);
+	pages = kmalloc(nr_pages * sizeof(struct page *), GFP_KERNEL);
 	if (!pages)
 		return NULL;
 
-	if (write == DL_DMA_BIDIRECTIONAL || write == DL_DMA_FROM_DEVICE)
-		write = 1;
-	else
-		write = 0;
-	
 	down_read(&current_task->mm->mmap_sem);
 	ret = get_user_pages(current_task, 
 	                     current_task->mm, 
 						 (unsigned long)ptr & PAGE_MASK, 
-						 *nr_pages, write, 0, pages, NULL);
+						 nr_pages, write, 0, pages, NULL);
 	up_read(&current_task->mm->mmap_sem);
 	
-	if (ret < *nr_pages)
+	if (ret < (int)nr_pages)
+	{
+		dl_unmap_user_pages(pages, ret < 0 ? 0 : ret, 0); 
+		return NULL;
+	}
+
+	return pages;
+}
+
+/*
+ * User regions pinned ahead of time, so that dl_get_user_pages calls made
+ * under the command gate find their pages without faulting them in. Regions
+ * pinned through BLACKMAGIC_IOC_PIN belong to a file and are also DMA
+ * mapped, so dl_dma_map_user_buffer can reuse the mapping.
+ */
+struct dl_pinned_region
+{
+	struct list_head entry;
+	atomic_t users;					/* The list, loans and borrowed DMA lists */
+	struct mm_struct *mm;			/* Referenced, so it can't be reused while pinned */
+	void *owner;					/* File that pinned it */
+	unsigned long addr;
+	unsigned long size;
+	int write;
+	unsigned long nr_pages;
+	struct page **pages;
+	void *pdev;
+	struct dl_dma_list *dma;		/* Bidirectional mapping of pages, or NULL */
+	struct work_struct work;		/* Uncharges and frees a region released in atomic context */
+};
+
+/* A page array handed out by dl_get_user_pages from a DMA mapped region */
+struct dl_pinned_loan
+{
+	struct list_head entry;
+	struct page **pages;
+	struct dl_pinned_region *region;
+	unsigned long first;
+};
+
+static LIST_HEAD(__dl_pinned_regions);
+static LIST_HEAD(__dl_pinned_loans);
+static DEFINE_SPINLOCK(__dl_pinned_regions_lock);
+static atomic_t __dl_pinned_region_count = ATOMIC_INIT(0);
+static atomic_t __dl_pinned_loan_count = ATOMIC_INIT(0);
+static atomic_t __dl_pinned_free_count = ATOMIC_INIT(0);
+
+static inline unsigned long dl_region_pages(unsigned long addr, unsigned long size)
+{
+	return ((addr + size - 1) >> PAGE_SHIFT) - (addr >> PAGE_SHIFT) + 1;
+}
+
+/*
+ * Pinned pages are charged to the pinning task's RLIMIT_MEMLOCK through
+ * locked_vm, as mlock'd pages are, unless it has CAP_IPC_LOCK.
+ */
+static int dl_charge_pinned_pages(struct mm_struct *mm, unsigned long nr_pages)
+{
+	unsigned long limit;
+	int ret = 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 33)
+	limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+#else
+	limit = current->signal->rlim[RLIMIT_MEMLOCK].rlim_cur >> PAGE_SHIFT;
+#endif
+
+	down_write(&mm->mmap_sem);
+	if (mm->locked_vm + nr_pages > limit && !capable(CAP_IPC_LOCK))
+		ret = -ENOMEM;
+	else
+		mm->locked_vm += nr_pages;
+	up_write(&mm->mmap_sem);
+
+	return ret;
+}
+
+static void dl_uncharge_pinned_pages(struct mm_struct *mm, unsigned long nr_pages)
+{
+	down_write(&mm->mmap_sem);
+	mm->locked_vm -= nr_pages;
+	up_write(&mm->mmap_sem);
+}
+
+static void __dl_free_pinned_region(struct dl_pinned_region *region)
+{
+	dl_uncharge_pinned_pages(region->mm, region->nr_pages);
+	mmdrop(region->mm);
+	kfree(region);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+static void dl_free_pinned_region_work(struct work_struct *work)
+{
+	struct dl_pinned_region *region = container_of(work, struct dl_pinned_region, work);
+#else
+static void dl_free_pinned_region_work(void *data)
+{
+	struct dl_pinned_region *region = data;
+#endif
+
+	__dl_free_pinned_region(region);
+	atomic_dec(&__dl_pinned_free_count);
+}
+
+void dl_pinned_region_put(void *handle)
+{
+	struct dl_pinned_region *region = handle;
+
+	if (!atomic_dec_and_test(&region->users))
+		return;
+
+	if (region->dma)
+		dl_dma_unmap_kernel_buffer(region->dma, DL_DMA_BIDIRECTIONAL);
+	dl_unmap_user_pages(region->pages, region->nr_pages, region->write);
+
+	/* Uncharging takes mmap_sem, so from a DMA unmap in atomic context it is deferred */
+	if (in_interrupt() || irqs_disabled())
+	{
+		atomic_inc(&__dl_pinned_free_count);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+		INIT_WORK(&region->work, dl_free_pinned_region_work);
+#else
+		INIT_WORK(&region->work, dl_free_pinned_region_work, region);
+#endif
+		schedule_work(&region->work);
+		return;
+	}
+
+	__dl_free_pinned_region(region);
+}
+
+/* Wait for regions released in atomic context to be freed, before unload */
+void dl_pinned_regions_exit(void)
+{
+	while (atomic_read(&__dl_pinned_free_count))
+		msleep(1);
+}
+
+/*
+ * Pin [ptr, ptr + size) of the current task until owner unpins it, DMA mapped
+ * for pdev. write is non-zero if the device will write to the region. Returns
+ * a handle, or an ERR_PTR; -ENOMEM if the pages would exceed RLIMIT_MEMLOCK.
+ */
+void *dl_pin_user_region_cached(void *owner, void *ptr, unsigned long size, int write, void *pdev)
+{
+	struct dl_pinned_region *region;
+	unsigned long flags;
+	int ret;
+
+	if (!size || !current->mm)
+		return ERR_PTR(-EINVAL);
+
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if (!region)
+		return ERR_PTR(-ENOMEM);
+
+	atomic_set(&region->users, 1);
+	region->mm = current->mm;
+	region->owner = owner;
+	region->addr = (unsigned long)ptr;
+	region->size = size;
+	region->write = !!write;
+	region->nr_pages = dl_region_pages(region->addr, size);
+
+	ret = dl_charge_pinned_pages(region->mm, region->nr_pages);
+	if (ret < 0)
+	{
+		kfree(region);
+		return ERR_PTR(ret);
+	}
+
+	region->pages = __dl_get_user_pages(current, ptr, region->nr_pages, region->write);
+	if (!region->pages)
 	{
-		dl_unmap_user_pages(pages, ret, 0); 
+		dl_uncharge_pinned_pages(region->mm, region->nr_pages);
+		kfree(region);
+		return ERR_PTR(-EFAULT);
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	mmgrab(region->mm);
+#else
+	atomic_inc(&region->mm->mm_count);
+#endif
+
+	if (pdev)
+	{
+		region->pdev = pdev;
+		region->dma = dl_dma_map_user_buffer(region->pages, region->nr_pages, DL_DMA_BIDIRECTIONAL, pdev);
+	}
+
+	spin_lock_irqsave(&__dl_pinned_regions_lock, flags);
+	list_add(&region->entry, &__dl_pinned_regions);
+	atomic_inc(&__dl_pinned_region_count);
+	spin_unlock_irqrestore(&__dl_pinned_regions_lock, flags);
+
+	return region;
+}
+
+static void __dl_unlink_pinned_region(struct dl_pinned_region *region)
+{
+	list_del(&region->entry);
+	atomic_dec(&__dl_pinned_region_count);
+}
+
+/*
+ * Drop owner's regions starting at addr, or all of them if addr is 0. Pages
+ * still lent to the support library stay pinned until it unmaps them.
+ */
+int dl_unpin_user_regions(void *owner, unsigned long addr)
+{
+	struct dl_pinned_region *region, *tmp;
+	LIST_HEAD(dead);
+	unsigned long flags;
+	int count = 0;
+
+	spin_lock_irqsave(&__dl_pinned_regions_lock, flags);
+	list_for_each_entry_safe(region, tmp, &__dl_pinned_regions, entry)
+	{
+		if (region->owner != owner || (addr && region->addr != addr))
+			continue;
+		__dl_unlink_pinned_region(region);
+		list_add(&region->entry, &dead);
+		count++;
+	}
+	spin_unlock_irqrestore(&__dl_pinned_regions_lock, flags);
+
+	list_for_each_entry_safe(region, tmp, &dead, entry)
+		dl_pinned_region_put(region);
+
+	return count;
+}
+
+/*
+ * Look for a pinned region of the task's address space covering the request
+ * and take another reference on its pages, in a page array that
+ * dl_unmap_user_pages frees.
+ */
+static struct page **
+dl_find_pinned_pages(struct task_struct *task, void *ptr, unsigned long size, unsigned long nr_pages, int write)
+{
+	struct dl_pinned_region *region;
+	struct dl_pinned_loan *loan;
+	struct page **pages = NULL;
+	unsigned long addr = (unsigned long)ptr;
+	unsigned long first, i, flags;
+
+	if (!atomic_read(&__dl_pinned_region_count))
 		return NULL;
+
+	spin_lock_irqsave(&__dl_pinned_regions_lock, flags);
+	list_for_each_entry(region, &__dl_pinned_regions, entry)
+	{
+		if (region->mm != task->mm || (write && !region->write))
+			continue;
+		if (addr < region->addr || addr + size > region->addr + region->size)
+			continue;
+
+		first = (addr >> PAGE_SHIFT) - (region->addr >> PAGE_SHIFT);
+		pages = kmalloc(nr_pages * sizeof(struct page *), GFP_ATOMIC);
+		if (!pages)
+			break;
+
+		/* Remember where DMA mapped pages came from for dl_dma_map_user_buffer */
+		if (region->dma)
+		{
+			loan = kmalloc(sizeof(*loan), GFP_ATOMIC);
+			if (!loan)
+			{
+				kfree(pages);
+				pages = NULL;
+				break;
+			}
+			loan->pages = pages;
+			loan->region = region;
+			loan->first = first;
+			atomic_inc(&region->users);
+			list_add(&loan->entry, &__dl_pinned_loans);
+			atomic_inc(&__dl_pinned_loan_count);
+		}
+
+		for (i = 0; i < nr_pages; i++)
+		{
+			pages[i] = region->pages[first + i];
+			get_page(pages[i]);
+		}
+		break;
 	}
+	spin_unlock_irqrestore(&__dl_pinned_regions_lock, flags);
 
 	return pages;
 }
 
+static struct dl_pinned_loan *__dl_find_loan(void *page_array)
+{
+	struct dl_pinned_loan *loan;
+
+	list_for_each_entry(loan, &__dl_pinned_loans, entry)
+	{
+		if (loan->pages == page_array)
+			return loan;
+	}
+
+	return NULL;
+}
+
+/*
+ * Called by dl_dma_map_user_buffer. If page_array was lent from a region DMA
+ * mapped for pdev, returns that region's mapping and the index of the first
+ * page, with a reference that dl_pinned_region_put drops.
+ */
+struct dl_dma_list *dl_pinned_dma_lookup(void *page_array, void *pdev, void **region, unsigned long *first)
+{
+	struct dl_pinned_loan *loan;
+	struct dl_dma_list *dma = NULL;
+	unsigned long flags;
+
+	if (!atomic_read(&__dl_pinned_loan_count))
+		return NULL;
+
+	spin_lock_irqsave(&__dl_pinned_regions_lock, flags);
+	loan = __dl_find_loan(page_array);
+	if (loan && loan->region->pdev == pdev)
+	{
+		dma = loan->region->dma;
+		*region = loan->region;
+		*first = loan->first;
+		atomic_inc(&loan->region->users);
+	}
+	spin_unlock_irqrestore(&__dl_pinned_regions_lock, flags);
+
+	return dma;
+}
+
+static void dl_return_loan(void *page_array)
+{
+	struct dl_pinned_loan *loan;
+	unsigned long flags;
+
+	if (!atomic_read(&__dl_pinned_loan_count))
+		return;
+
+	spin_lock_irqsave(&__dl_pinned_regions_lock, flags);
+	loan = __dl_find_loan(page_array);
+	if (loan)
+	{
+		list_del(&loan->entry);
+		atomic_dec(&__dl_pinned_loan_count);
+	}
+	spin_unlock_irqrestore(&__dl_pinned_regions_lock, flags);
+
+	if (loan)
+	{
+		dl_pinned_region_put(loan->region);
+		kfree(loan);
+	}
+}
+
+void *
+dl_get_user_pages(void *task_ptr, void *ptr, unsigned long size, unsigned long *nr_pages, int write)
+{
+	struct task_struct *current_task = task_ptr;
+	struct page **pages;
+	
+	if (!current_task)
+		return NULL;
+
+	*nr_pages = dl_region_pages((unsigned long)ptr, size);
+
+	if (write == DL_DMA_BIDIRECTIONAL || write == DL_DMA_FROM_DEVICE)
+		write = 1;
+	else
+		write = 0;
+
+	pages = dl_find_pinned_pages(current_task, ptr, size, *nr_pages, write);
+	if (pages)
+		return pages;
+
+	return __dl_get_user_pages(current_task, ptr, *nr_pages, write);
+}
+
 void
 dl_unmap_user_pages(void *ptr, unsigned long nr_pages, int flag_dirty)
 {
@@ -703,12 +1205,14 @@ dl_unmap_user_pages(void *ptr, unsigned long nr_pages, int flag_dirty)
 			SetPageDirty(p);
 		page_cache_release(p);
 	}
+	dl_return_loan(ptr);
 	kfree(ptr);
 }
 
 inline struct dl_wait_queue_head_t *dl_alloc_waitqueue(void)
 {
 	struct dl_wait_queue_head_t *queue;
+	unsigned long flags;
 	
 	if (__dl_wait_queue_cache == NULL)
 	{
@@ -732,14 +1236,32 @@ inline struct dl_wait_queue_head_t *dl_alloc_waitqueue(void)
 		init_waitqueue_head(&queue->wqh);
 		INIT_LIST_HEAD(&queue->entry);
 		atomic_set(&queue->state, 0);
-		atomic_set(&queue->sleepers, 0);
+		atomic_set(&queue->seq, 0);
+		queue->event_class = DL_EVENT_CLASS_NONE;
+		INIT_LIST_HEAD(&queue->bindings);
+		atomic_long_set(&queue->wakeups, 0);
+		atomic_long_set(&queue->skipped, 0);
 		queue->private_data = NULL;
+
+		spin_lock_irqsave(&__dl_wait_queues_lock, flags);
+		list_add_tail(&queue->entry, &__dl_wait_queues);
+		spin_unlock_irqrestore(&__dl_wait_queues_lock, flags);
 	}
 	return queue;
 }
 
+static void dl_event_detach_queue(struct dl_wait_queue_head_t *queue);
+
 void dl_free_waitqueue(struct dl_wait_queue_head_t *queue)
 {
+	unsigned long flags;
+
+	dl_event_detach_queue(queue);
+
+	spin_lock_irqsave(&__dl_wait_queues_lock, flags);
+	list_del(&queue->entry);
+	spin_unlock_irqrestore(&__dl_wait_queues_lock, flags);
+
 	kmem_cache_free(__dl_wait_queue_cache, queue);
 }
 
@@ -748,9 +1270,29 @@ void *dl_get_wait_queue_ptr(struct dl_wait_queue_head_t *queue)
 	return &queue->wqh;
 }
 
+/*
+ * Most events arrive with nobody waiting, so check before taking the wait
+ * queue lock. The barrier pairs with the one in prepare_to_wait and
+ * dl_poll_wait, so a waiter either sees the new state or is seen here.
+ */
 inline void dl_set_wait_queue_event(struct dl_wait_queue_head_t *queue)
 {
 	atomic_set(&queue->state, 1);
+	atomic_inc(&queue->seq);
+	smp_mb();
+
+	if (!list_empty(&queue->bindings))
+		dl_event_signal(queue);
+
+	if (!waitqueue_active(&queue->wqh))
+	{
+		atomic_long_inc(&queue->skipped);
+		atomic_long_inc(&__dl_wait_queue_skipped);
+		return;
+	}
+
+	atomic_long_inc(&queue->wakeups);
+	atomic_long_inc(&__dl_wait_queue_wakeups);
 	wake_up_interruptible(&queue->wqh);
 }
 
@@ -764,6 +1306,41 @@ inline int dl_get_wait_queue_event_state(struct dl_wait_queue_head_t *queue)
 	return atomic_read(&queue->state);	
 }
 
+void dl_get_wait_queue_stats(struct dl_wait_queue_head_t *queue, struct dl_wait_queue_stats *stats)
+{
+	if (queue)
+	{
+		stats->wakeups = atomic_long_read(&queue->wakeups);
+		stats->skipped = atomic_long_read(&queue->skipped);
+		stats->event_class = queue->event_class;
+	}
+	else
+	{
+		stats->wakeups = atomic_long_read(&__dl_wait_queue_wakeups);
+		stats->skipped = atomic_long_read(&__dl_wait_queue_skipped);
+		stats->event_class = DL_EVENT_CLASS_NONE;
+	}
+}
+
+/*
+ * Call fn with the counters of every allocated queue. fn runs under a
+ * spinlock, so it must not sleep.
+ */
+void dl_walk_wait_queue_stats(void (*fn)(void *arg, const struct dl_wait_queue_stats *), void *arg)
+{
+	struct dl_wait_queue_head_t *queue;
+	struct dl_wait_queue_stats stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&__dl_wait_queues_lock, flags);
+	list_for_each_entry(queue, &__dl_wait_queues, entry)
+	{
+		dl_get_wait_queue_stats(queue, &stats);
+		fn(arg, &stats);
+	}
+	spin_unlock_irqrestore(&__dl_wait_queues_lock, flags);
+}
+
 void dl_destroy_wait_queue_cache(void)
 {
 	if (__dl_wait_queue_cache != NULL)
@@ -773,12 +1350,357 @@ void dl_destroy_wait_queue_cache(void)
 	}
 }
 
+static struct dl_event_cursor *dl_find_event_cursor(void *filp)
+{
+	struct dl_event_cursor *cursor;
+
+	list_for_each_entry(cursor, &__dl_event_cursors, entry)
+	{
+		if (cursor->filp == filp)
+			return cursor;
+	}
+
+	return NULL;
+}
+
+/*
+ * Switch a file to edge-triggered events: POLLIN/POLLOUT then mean "the
+ * sequence number advanced since dl_event_cursor_read", not "the event is set".
+ */
+int dl_event_cursor_open(void *filp)
+{
+	struct dl_event_cursor *cursor;
+	unsigned long flags;
+
+	cursor = kzalloc(sizeof(*cursor), GFP_KERNEL);
+	if (!cursor)
+		return -ENOMEM;
+	cursor->filp = filp;
+
+	spin_lock_irqsave(&__dl_event_cursors_lock, flags);
+	if (dl_find_event_cursor(filp))
+	{
+		spin_unlock_irqrestore(&__dl_event_cursors_lock, flags);
+		kfree(cursor);
+		return 0;
+	}
+	list_add(&cursor->entry, &__dl_event_cursors);
+	atomic_inc(&__dl_event_cursor_count);
+	spin_unlock_irqrestore(&__dl_event_cursors_lock, flags);
+
+	return 0;
+}
+
+void dl_event_cursor_close(void *filp)
+{
+	struct dl_event_cursor *cursor;
+	unsigned long flags;
+
+	if (!atomic_read(&__dl_event_cursor_count))
+		return;
+
+	spin_lock_irqsave(&__dl_event_cursors_lock, flags);
+	cursor = dl_find_event_cursor(filp);
+	if (cursor)
+	{
+		list_del(&cursor->entry);
+		atomic_dec(&__dl_event_cursor_count);
+	}
+	spin_unlock_irqrestore(&__dl_event_cursors_lock, flags);
+
+	kfree(cursor);
+}
+
+/*
+ * Return the sequence numbers seen by the last poll of each direction and
+ * how many events each advanced by since the previous read, then mark them
+ * read. Callers poll first so the sequence numbers are current.
+ */
+int dl_event_cursor_read(void *filp, unsigned int seq[2], unsigned int events[2])
+{
+	struct dl_event_cursor *cursor;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&__dl_event_cursors_lock, flags);
+	cursor = dl_find_event_cursor(filp);
+	if (cursor)
+	{
+		for (i = 0; i < 2; i++)
+		{
+			seq[i] = cursor->dir[i].seq;
+			events[i] = cursor->dir[i].seq - cursor->dir[i].seen;
+			cursor->dir[i].seen = cursor->dir[i].seq;
+		}
+	}
+	spin_unlock_irqrestore(&__dl_event_cursors_lock, flags);
+
+	return cursor ? 0 : -EINVAL;
+}
+
+/* Returns 1 if ready, 0 if not, -1 if the file isn't edge-triggered */
+static int dl_event_cursor_poll(void *filp, struct dl_wait_queue_head_t *queue, int write)
+{
+	struct dl_event_cursor *cursor;
+	unsigned int seq = atomic_read(&queue->seq);
+	unsigned long flags;
+	int ready = -1;
+
+	spin_lock_irqsave(&__dl_event_cursors_lock, flags);
+	cursor = dl_find_event_cursor(filp);
+	if (cursor)
+	{
+		/* A different queue is a new stream: start from its current position */
+		if (cursor->dir[write].queue != queue)
+		{
+			cursor->dir[write].queue = queue;
+			cursor->dir[write].seen = seq;
+		}
+		cursor->dir[write].seq = seq;
+		ready = (seq != cursor->dir[write].seen);
+	}
+	spin_unlock_irqrestore(&__dl_event_cursors_lock, flags);
+
+	return ready;
+}
+
+/*
+ * Write to a file from kernel space. Used for eventfds and for
+ * /dev/cpu_dma_latency, whose in-kernel APIs are GPL-only.
+ */
+ssize_t dl_kernel_write(struct file *file, const void *buf, size_t count)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	loff_t pos = 0;
+	return kernel_write(file, buf, count, &pos);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+	return kernel_write(file, (const char *)buf, count, 0);
+#else
+	mm_segment_t fs = get_fs();
+	loff_t pos = 0;
+	ssize_t ret;
+
+	set_fs(KERNEL_DS);
+	ret = vfs_write(file, (const char __user *)buf, count, &pos);
+	set_fs(fs);
+	return ret;
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+static void dl_event_binding_work(struct work_struct *work)
+{
+	struct dl_event_binding *binding = container_of(work, struct dl_event_binding, work.work);
+#else
+static void dl_event_binding_work(void *data)
+{
+	struct dl_event_binding *binding = (struct dl_event_binding *)data;
+#endif
+	u64 count = atomic_xchg(&binding->pending, 0);
+
+	if (count)
+		dl_kernel_write(binding->eventfd, &count, sizeof(count));
+}
+
+static struct dl_event_binding *dl_find_event_binding(void *client)
+{
+	struct dl_event_binding *binding;
+
+	list_for_each_entry(binding, &__dl_event_bindings, entry)
+	{
+		if (binding->client == client)
+			return binding;
+	}
+
+	return NULL;
+}
+
+/* Called with __dl_event_bindings_lock held */
+static void __dl_event_unlink(struct dl_event_binding_link *link)
+{
+	struct dl_event_binding *binding = link->binding;
+	struct dl_event_binding_link *last = &binding->links[--binding->nr_queues];
+
+	list_del(&link->entry);
+	if (link != last)
+	{
+		// Keep the binding's links packed
+		list_replace(&last->entry, &link->entry);
+		link->queue = last->queue;
+	}
+}
+
+static void dl_event_detach_queue(struct dl_wait_queue_head_t *queue)
+{
+	unsigned long flags;
+
+	if (list_empty(&queue->bindings))
+		return;
+
+	spin_lock_irqsave(&__dl_event_bindings_lock, flags);
+	while (!list_empty(&queue->bindings))
+		__dl_event_unlink(list_first_entry(&queue->bindings, struct dl_event_binding_link, entry));
+	spin_unlock_irqrestore(&__dl_event_bindings_lock, flags);
+}
+
+/* Called with __dl_event_bindings_lock held */
+static void dl_event_attach_queue(struct dl_event_binding *binding, struct dl_wait_queue_head_t *queue)
+{
+	struct dl_event_binding_link *link;
+	unsigned int i;
+
+	for (i = 0; i < binding->nr_queues; i++)
+	{
+		if (binding->links[i].queue == queue)
+			return;
+	}
+
+	if (binding->nr_queues == DL_EVENT_BINDING_QUEUES)
+		return;
+
+	link = &binding->links[binding->nr_queues++];
+	link->binding = binding;
+	link->queue = queue;
+	list_add_tail(&link->entry, &queue->bindings);
+}
+
+static void dl_event_signal(struct dl_wait_queue_head_t *queue)
+{
+	struct dl_event_binding_link *link;
+	unsigned long flags;
+
+	spin_lock_irqsave(&__dl_event_bindings_lock, flags);
+	list_for_each_entry(link, &queue->bindings, entry)
+	{
+		struct dl_event_binding *binding = link->binding;
+
+		if ((binding->classes & (1 << queue->event_class)) &&
+			atomic_inc_return(&binding->pending) == 1)
+			schedule_delayed_work(&binding->work, 0);
+	}
+	spin_unlock_irqrestore(&__dl_event_bindings_lock, flags);
+}
+
+/*
+ * Bind an eventfd to a user client's notification classes (1 << DL_EVENT_CLASS_*),
+ * replacing any earlier binding. Takes over the reference to eventfd.
+ */
+int dl_event_bind(void *client, struct file *eventfd, unsigned int classes)
+{
+	struct dl_event_binding *binding;
+	unsigned long flags;
+
+	binding = kzalloc(sizeof(*binding), GFP_KERNEL);
+	if (!binding)
+		return -ENOMEM;
+
+	binding->client = client;
+	binding->eventfd = eventfd;
+	binding->classes = classes;
+	atomic_set(&binding->pending, 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+	INIT_DELAYED_WORK(&binding->work, dl_event_binding_work);
+#else
+	INIT_WORK(&binding->work, dl_event_binding_work, binding);
+#endif
+
+	dl_event_unbind(client);
+
+	spin_lock_irqsave(&__dl_event_bindings_lock, flags);
+	list_add(&binding->entry, &__dl_event_bindings);
+	atomic_inc(&__dl_event_binding_count);
+	spin_unlock_irqrestore(&__dl_event_bindings_lock, flags);
+
+	return 0;
+}
+
+void dl_event_unbind(void *client)
+{
+	struct dl_event_binding *binding;
+	unsigned long flags;
+
+	if (!atomic_read(&__dl_event_binding_count))
+		return;
+
+	spin_lock_irqsave(&__dl_event_bindings_lock, flags);
+	binding = dl_find_event_binding(client);
+	if (binding)
+	{
+		while (binding->nr_queues)
+			__dl_event_unlink(&binding->links[0]);
+		list_del(&binding->entry);
+		atomic_dec(&__dl_event_binding_count);
+	}
+	spin_unlock_irqrestore(&__dl_event_bindings_lock, flags);
+
+	if (!binding)
+		return;
+
+	cancel_delayed_work_sync(&binding->work);
+	fput(binding->eventfd);
+	kfree(binding);
+}
+
+/*
+ * Tell the shim which client a queue belongs to and what it signals. Input
+ * and output queues are also learned when the client polls; audio and API
+ * notification queues can only be bound through this call, which the support
+ * library does not make, so BLACKMAGIC_IOC_EVENTFD_BIND refuses those classes.
+ */
+void dl_set_wait_queue_class(struct dl_wait_queue_head_t *queue, void *client, int event_class)
+{
+	struct dl_event_binding *binding;
+	unsigned long flags;
+
+	queue->event_class = event_class;
+
+	if (!atomic_read(&__dl_event_binding_count))
+		return;
+
+	spin_lock_irqsave(&__dl_event_bindings_lock, flags);
+	binding = dl_find_event_binding(client);
+	if (binding)
+		dl_event_attach_queue(binding, queue);
+	spin_unlock_irqrestore(&__dl_event_bindings_lock, flags);
+}
+
+/* Learn a bound client's input and output queues from its polls */
+static void dl_event_learn_queue(struct file *filp, struct dl_wait_queue_head_t *queue, int write)
+{
+	struct dl_event_binding *binding;
+	unsigned long flags;
+
+	spin_lock_irqsave(&__dl_event_bindings_lock, flags);
+	binding = dl_find_event_binding(filp->private_data);
+	if (binding)
+	{
+		if (queue->event_class == DL_EVENT_CLASS_NONE)
+			queue->event_class = write ? DL_EVENT_CLASS_OUTPUT : DL_EVENT_CLASS_INPUT;
+		dl_event_attach_queue(binding, queue);
+	}
+	spin_unlock_irqrestore(&__dl_event_bindings_lock, flags);
+}
+
 unsigned int
 dl_poll_wait(void *filp, struct dl_wait_queue_head_t *queue, void *wait, int write)
 {
 	unsigned int mask = 0;
+	int ready;
 
 	poll_wait((struct file *)filp, &queue->wqh, wait);
+	/* Pairs with the barrier in dl_set_wait_queue_event */
+	smp_mb();
+
+	write = !!write;
+	if (atomic_read(&__dl_event_binding_count))
+		dl_event_learn_queue((struct file *)filp, queue, write);
+
+	if (atomic_read(&__dl_event_cursor_count))
+	{
+		ready = dl_event_cursor_poll(filp, queue, write);
+		if (ready >= 0)
+			return ready ? (write ? POLLOUT | POLLWRNORM : POLLIN | POLLRDNORM) : 0;
+	}
 
 	if ((atomic_read(&queue->state) == 1) && write)
 		return mask |= POLLOUT | POLLWRNORM;
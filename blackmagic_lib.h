@@ -43,6 +43,10 @@ extern unsigned long __dl_copy_to_user(void *to, const void *from, unsigned long
 extern int dl_access_ok(int type, void *addr, unsigned long size);
 extern void *dl_get_user_pages(void *task_ptr, void *ptr, unsigned long size, unsigned long *, int);
 extern void dl_unmap_user_pages(void *ptr, unsigned long nr_pages, int flag_dirty);
+extern void *dl_pin_user_region_cached(void *owner, void *ptr, unsigned long size, int write, void *pdev);
+extern void dl_pinned_regions_exit(void);
+extern int dl_unpin_user_regions(void *owner, unsigned long addr);
+extern void dl_pinned_region_put(void *region);
 extern void *dl_get_current(void);
 
 extern int dl_flush_cache_all(void);
@@ -68,6 +72,7 @@ extern struct dl_dma_list*
 dl_dma_map_kernel_buffer(void *address, unsigned long size, int direction, int is_vmalloc, void* pdev);
 extern dl_dma_addr_t dl_dma_get_physical_segment(struct dl_dma_list* sl, void* address, unsigned long offset, unsigned long* length);
 extern void dl_dma_unmap_kernel_buffer(struct dl_dma_list* sl, int direction);
+extern struct dl_dma_list *dl_pinned_dma_lookup(void *page_array, void *pdev, void **region, unsigned long *first);
 
 enum {
 	DL_DMA_TO_DEVICE = 0,
@@ -95,6 +100,8 @@ extern void dl_msleep(unsigned long);
 #define kMillisecondScale	1
 extern unsigned long dl_jiffies_in_unit(long value, int unit);
 extern void dl_backtrace(void);
+extern void dl_trace_freeze(void);
+extern void dl_trace_thaw(void);
 
 extern unsigned int dl_strlen(const char *s);
 extern char *dl_strncpy(char *s1, const char *s2, unsigned int n);
@@ -134,6 +141,13 @@ extern int dl_sema_down_timeout(void *, unsigned long timeout, unsigned int *);
 extern void dl_sema_up(void *);
 extern void dl_sema_free(void *);
 
+/* Read-mostly snapshots: written by the bottom half and setters, read without the gate */
+struct dl_snapshot_t;
+extern struct dl_snapshot_t *dl_alloc_snapshot(unsigned int size);
+extern void dl_free_snapshot(struct dl_snapshot_t *);
+extern int dl_snapshot_publish(struct dl_snapshot_t *, unsigned int offset, const void *src, unsigned int size);
+extern int dl_snapshot_read(struct dl_snapshot_t *, unsigned int offset, void *dst, unsigned int size);
+
 #define THREAD_INTERRUPTED	0
 #define THREAD_AWAKENED		1
 #define THREAD_TIMED_OUT	2
@@ -161,6 +175,34 @@ extern void dl_set_wait_queue_event(struct dl_wait_queue_head_t *);
 extern void dl_clear_wait_queue_event(struct dl_wait_queue_head_t *);
 extern int dl_get_wait_event_state(struct dl_wait_queue_head_t *);
 extern unsigned int dl_poll_wait(void *filp, struct dl_wait_queue_head_t *queue, void *wait, int write);
+extern int dl_event_cursor_open(void *filp);
+extern void dl_event_cursor_close(void *filp);
+extern int dl_event_cursor_read(void *filp, unsigned int seq[2], unsigned int events[2]);
+
+/* Notification classes for eventfd bindings */
+enum {
+	DL_EVENT_CLASS_NONE = 0,
+	DL_EVENT_CLASS_INPUT,			/* Input frame arrived */
+	DL_EVENT_CLASS_OUTPUT,			/* Output frame completed */
+	DL_EVENT_CLASS_AUDIO,			/* Audio interrupt */
+	DL_EVENT_CLASS_NOTIFICATION,	/* API notification */
+};
+
+struct file;
+extern int dl_event_bind(void *client, struct file *eventfd, unsigned int classes);
+extern void dl_event_unbind(void *client);
+extern void dl_set_wait_queue_class(struct dl_wait_queue_head_t *, void *client, int event_class);
+extern ssize_t dl_kernel_write(struct file *, const void *buf, size_t count);
+
+struct dl_wait_queue_stats
+{
+	unsigned long wakeups;
+	unsigned long skipped;
+	int event_class;				/* DL_EVENT_CLASS_* */
+};
+/* Pass a NULL queue for totals across all queues */
+extern void dl_get_wait_queue_stats(struct dl_wait_queue_head_t *, struct dl_wait_queue_stats *);
+extern void dl_walk_wait_queue_stats(void (*fn)(void *arg, const struct dl_wait_queue_stats *), void *arg);
 extern void dl_destroy_wait_queue_cache(void);
 
 /* FPU save/restore */
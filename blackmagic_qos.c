@@ -0,0 +1,281 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "blackmagic_qos.h"
+
+/*
+ * CPU wakeup latency to request per card ID while it streams, in us.
+ * -1 (the default) leaves C-states alone.
+ */
+static int blackmagic_cpu_latency_us[BLACKMAGIC_MAX_DEVICES] = { [0 ... BLACKMAGIC_MAX_DEVICES - 1] = -1 };
+static int blackmagic_cpu_latency_count = 0;
+module_param_array(blackmagic_cpu_latency_us, int, &blackmagic_cpu_latency_count, S_IRUGO);
+
+/* Time after the last stream stops before the request is dropped */
+static unsigned int blackmagic_cpu_latency_idle_ms = 1000;
+module_param(blackmagic_cpu_latency_idle_ms, uint, S_IRUGO | S_IWUSR);
+
+#define CPU_LATENCY_INPUT		0x1
+#define CPU_LATENCY_OUTPUT		0x2
+
+/* Support library commands that enable and disable streams */
+static const struct {
+	unsigned int cmd;
+	unsigned int stream;
+	bool on;
+} cpu_latency_cmds[] =
+{
+	{ DL_CMD_VIDEO_OUTPUT_ON, CPU_LATENCY_OUTPUT, true },
+	{ DL_CMD_VIDEO_OUTPUT_OFF, CPU_LATENCY_OUTPUT, false },
+	{ DL_CMD_VIDEO_INPUT_ON, CPU_LATENCY_INPUT, true },
+	{ DL_CMD_VIDEO_INPUT_OFF, CPU_LATENCY_INPUT, false },
+};
+
+/* A file with streams enabled, on the device's clients list */
+struct blackmagic_cpu_latency_client
+{
+	struct list_head entry;
+	struct file *filp;
+	unsigned int streams;		/* CPU_LATENCY_INPUT | CPU_LATENCY_OUTPUT */
+};
+
+/*
+ * The PM QoS API is GPL-only, so the request is made the way userspace
+ * makes it: held for as long as /dev/cpu_dma_latency is open.
+ */
+static struct file *cpu_latency_request(s32 target_us)
+{
+	struct file *file;
+	ssize_t ret;
+
+	file = filp_open("/dev/cpu_dma_latency", O_WRONLY, 0);
+	if (IS_ERR(file))
+		return file;
+
+	ret = dl_kernel_write(file, &target_us, sizeof(target_us));
+	if (ret != sizeof(target_us))
+	{
+		filp_close(file, NULL);
+		return ERR_PTR(ret < 0 ? ret : -EIO);
+	}
+
+	return file;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+static void blackmagic_cpu_latency_work(struct work_struct *work)
+{
+	struct blackmagic_cpu_latency *lat = container_of(work, struct blackmagic_cpu_latency, work.work);
+#else
+static void blackmagic_cpu_latency_work(void *data)
+{
+	struct blackmagic_cpu_latency *lat = (struct blackmagic_cpu_latency *)data;
+#endif
+	struct file *file;
+	unsigned int streams;
+
+	if (atomic_read(&lat->state) == CPU_LATENCY_DISABLED)
+		return;
+
+	spin_lock(&lat->lock);
+	streams = lat->streams;
+	spin_unlock(&lat->lock);
+
+	if (streams && !lat->file)
+	{
+		file = cpu_latency_request(lat->target_us);
+		if (IS_ERR(file))
+		{
+			/* Stay idle; the next stream start tries again */
+			dl_info("cpu latency request failed (%ld)\n", PTR_ERR(file));
+			return;
+		}
+		lat->file = file;
+		lat->requests++;
+		atomic_set(&lat->state, CPU_LATENCY_ACTIVE);
+	}
+	else if (!streams && lat->file)
+	{
+		filp_close(lat->file, NULL);
+		lat->file = NULL;
+		atomic_set(&lat->state, CPU_LATENCY_IDLE);
+	}
+}
+
+static struct blackmagic_cpu_latency_client *
+cpu_latency_find_client(struct blackmagic_cpu_latency *lat, struct file *filp)
+{
+	struct blackmagic_cpu_latency_client *client;
+
+	list_for_each_entry(client, &lat->clients, entry)
+	{
+		if (client->filp == filp)
+			return client;
+	}
+
+	return NULL;
+}
+
+/*
+ * Called with lat->lock held when the device's stream count has changed. A
+ * stream start while no request is held (re)tries to make one.
+ */
+static void cpu_latency_streams_changed(struct blackmagic_cpu_latency *lat, unsigned int old)
+{
+	if (lat->streams > old && atomic_read(&lat->state) == CPU_LATENCY_IDLE)
+		schedule_delayed_work(&lat->work, 0);
+	else if (old && !lat->streams)
+		schedule_delayed_work(&lat->work, msecs_to_jiffies(blackmagic_cpu_latency_idle_ms));
+}
+
+/* Follow stream enables and disables made through a successful library command */
+void blackmagic_cpu_latency_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd)
+{
+	struct blackmagic_cpu_latency *lat = &ddev->cpu_latency;
+	struct blackmagic_cpu_latency_client *client, *new_client = NULL;
+	unsigned int i, old;
+
+	if (atomic_read(&lat->state) == CPU_LATENCY_DISABLED)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(cpu_latency_cmds); i++)
+	{
+		if (cpu_latency_cmds[i].cmd == cmd)
+			break;
+	}
+	if (i == ARRAY_SIZE(cpu_latency_cmds))
+		return;
+
+	if (cpu_latency_cmds[i].on)
+	{
+		new_client = kzalloc(sizeof(*new_client), GFP_KERNEL);
+		if (!new_client)
+			return;
+		new_client->filp = filp;
+	}
+
+	spin_lock(&lat->lock);
+	old = lat->streams;
+	client = cpu_latency_find_client(lat, filp);
+	if (!client && new_client)
+	{
+		client = new_client;
+		new_client = NULL;
+		list_add(&client->entry, &lat->clients);
+	}
+	if (client)
+	{
+		if (cpu_latency_cmds[i].on && !(client->streams & cpu_latency_cmds[i].stream))
+		{
+			client->streams |= cpu_latency_cmds[i].stream;
+			lat->streams++;
+		}
+		else if (!cpu_latency_cmds[i].on && (client->streams & cpu_latency_cmds[i].stream))
+		{
+			client->streams &= ~cpu_latency_cmds[i].stream;
+			lat->streams--;
+		}
+		if (!client->streams)
+			list_del(&client->entry);
+		else
+			client = NULL;
+	}
+	cpu_latency_streams_changed(lat, old);
+	spin_unlock(&lat->lock);
+
+	kfree(client);
+	kfree(new_client);
+}
+
+/* The support library stops a closed file's streams, so stop counting them */
+void blackmagic_cpu_latency_release(struct blackmagic_device *ddev, struct file *filp)
+{
+	struct blackmagic_cpu_latency *lat = &ddev->cpu_latency;
+	struct blackmagic_cpu_latency_client *client;
+	unsigned int old;
+
+	spin_lock(&lat->lock);
+	old = lat->streams;
+	client = cpu_latency_find_client(lat, filp);
+	if (client)
+	{
+		list_del(&client->entry);
+		lat->streams -= hweight32(client->streams);
+		cpu_latency_streams_changed(lat, old);
+	}
+	spin_unlock(&lat->lock);
+
+	kfree(client);
+}
+
+void blackmagic_cpu_latency_init(struct blackmagic_device *ddev)
+{
+	struct blackmagic_cpu_latency *lat = &ddev->cpu_latency;
+
+	lat->target_us = -1;
+	if (ddev->id >= 0 && ddev->id < blackmagic_cpu_latency_count)
+		lat->target_us = blackmagic_cpu_latency_us[ddev->id];
+
+	atomic_set(&lat->state, lat->target_us < 0 ? CPU_LATENCY_DISABLED : CPU_LATENCY_IDLE);
+	spin_lock_init(&lat->lock);
+	INIT_LIST_HEAD(&lat->clients);
+	lat->streams = 0;
+	lat->file = NULL;
+	lat->requests = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+	INIT_DELAYED_WORK(&lat->work, blackmagic_cpu_latency_work);
+#else
+	INIT_WORK(&lat->work, blackmagic_cpu_latency_work, lat);
+#endif
+}
+
+void blackmagic_cpu_latency_remove(struct blackmagic_device *ddev)
+{
+	struct blackmagic_cpu_latency *lat = &ddev->cpu_latency;
+
+	struct blackmagic_cpu_latency_client *client, *tmp;
+
+	atomic_set(&lat->state, CPU_LATENCY_DISABLED);
+	cancel_delayed_work_sync(&lat->work);
+
+	if (lat->file)
+	{
+		filp_close(lat->file, NULL);
+		lat->file = NULL;
+	}
+
+	list_for_each_entry_safe(client, tmp, &lat->clients, entry)
+		kfree(client);
+	INIT_LIST_HEAD(&lat->clients);
+	lat->streams = 0;
+}
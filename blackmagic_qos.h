@@ -0,0 +1,51 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+#ifndef BLACKMAGIC_QOS_H
+#define BLACKMAGIC_QOS_H
+
+#include "blackmagic_core.h"
+
+/*
+ * CPU latency request held while a device is streaming. A stream is counted
+ * from a successful video input or output enable command until it is
+ * disabled or its file is closed; the request is dropped once no stream has
+ * run for blackmagic_cpu_latency_idle_ms.
+ */
+enum {
+	CPU_LATENCY_IDLE = 0,
+	CPU_LATENCY_ACTIVE,
+	CPU_LATENCY_DISABLED,
+};
+
+void blackmagic_cpu_latency_init(struct blackmagic_device *ddev);
+void blackmagic_cpu_latency_remove(struct blackmagic_device *ddev);
+void blackmagic_cpu_latency_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd);
+void blackmagic_cpu_latency_release(struct blackmagic_device *ddev, struct file *filp);
+
+#endif
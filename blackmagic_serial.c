@@ -26,20 +26,35 @@
 */
 
 #include <linux/kernel.h>
+#include <linux/module.h>
 #include <linux/sched.h>
 #include <linux/tty.h>
 #include <linux/tty_driver.h>
 #include <linux/tty_flip.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
 #include "blackmagic_core.h"
+#include "blackmagic_ioctl.h"
+#include "blackmagic_deck.h"
 
 extern struct blackmagic_device *blackmagic_find_device_by_id(int);
 extern struct blackmagic_device *blackmagic_find_device_by_ptr(void *);
+extern struct blackmagic_device *blackmagic_find_device_in_isr(void *);
+extern void blackmagic_synchronize_isr(struct blackmagic_device *);
 
 static struct tty_driver *blackmagic_tty_driver = NULL;
 
+/* Runs rx_work; high priority so TTY delivery does not queue behind other work */
+static struct workqueue_struct *blackmagic_serial_wq = NULL;
+
+/* Capacity of each serial ring in bytes, rounded up to a power of two */
+static unsigned int blackmagic_serial_buffer_size = PAGE_SIZE;
+module_param(blackmagic_serial_buffer_size, uint, S_IRUGO);
+
 static inline void *get_driver_from_serial(struct blackmagic_serial *sdev)
 {
-	return container_of(sdev, struct blackmagic_device, sdev)->driver;
+	return sdev->ddev->driver;
 }
 
 static inline struct tty_struct *get_tty_from_serial(struct blackmagic_serial *sdev)
@@ -57,10 +72,10 @@ static inline struct blackmagic_serial *find_serial_by_tty(struct tty_struct *tt
 	if (!ddev)
 		return ERR_PTR(-ENODEV);
 
-	if (!(ddev->flags & BLACKMAGIC_DEV_HAS_SERIAL))
+	if (!(ddev->flags & BLACKMAGIC_DEV_HAS_SERIAL) || !ddev->sdev)
 		return ERR_PTR(-ENODEV);
 
-	return &ddev->sdev;
+	return ddev->sdev;
 }
 
 static inline struct blackmagic_serial *find_serial_by_ptr(void *ptr)
@@ -69,10 +84,36 @@ static inline struct blackmagic_serial *find_serial_by_ptr(void *ptr)
 	if (!ddev)
 		return ERR_PTR(-ENODEV);
 
-	if (!(ddev->flags & BLACKMAGIC_DEV_HAS_SERIAL))
+	if (!(ddev->flags & BLACKMAGIC_DEV_HAS_SERIAL) || !ddev->sdev)
 		return ERR_PTR(-ENODEV);
 
-	return &ddev->sdev;
+	return ddev->sdev;
+}
+
+/*
+ * Take a reference on the port for a client call. The port is not freed
+ * until the last reference is dropped with serial_put.
+ */
+static struct blackmagic_serial *serial_get(struct blackmagic_device *ddev)
+{
+	struct blackmagic_serial *sdev;
+	unsigned long iflags;
+
+	spin_lock_irqsave(&ddev->serial_lock, iflags);
+		sdev = ddev->sdev;
+		if (sdev && !sdev->gone)
+			atomic_inc(&sdev->users);
+		else
+			sdev = NULL;
+	spin_unlock_irqrestore(&ddev->serial_lock, iflags);
+
+	return sdev;
+}
+
+static void serial_put(struct blackmagic_device *ddev, struct blackmagic_serial *sdev)
+{
+	if (atomic_dec_and_test(&sdev->users))
+		wake_up_all(&ddev->serial_rx_wait);
 }
 
 static inline int test_and_change_open_state(struct blackmagic_serial *sdev, enum blackmagic_serial_open_states required_state, enum blackmagic_serial_open_states new_state)
@@ -85,41 +126,61 @@ static inline int test_and_change_open_state(struct blackmagic_serial *sdev, enu
 	return -EBUSY;
 }
 
-static void blackmagic_serial_reset_buffers(struct blackmagic_serial *sdev)
+/*
+ * Empty the read ring of a port that has just been closed. Once the RX
+ * interrupt is done with the old state nothing produces into it, and
+ * read_lock keeps rx_work and the readers out.
+ */
+static void blackmagic_serial_reset_read_buffers(struct blackmagic_serial *sdev)
 {
-	struct blackmagic_serial_buffer *buffer = &sdev->write_buffer;
-	
-	/* init write buffer */
-	memset(buffer->data, 0x0, sizeof(BLACKMAGIC_SERIAL_BUFFER_SIZE));
-	buffer->available_bytes = 0;
-	buffer->end = buffer->data + BLACKMAGIC_SERIAL_BUFFER_SIZE;
-	buffer->next = buffer->last = buffer->data;
+	unsigned long iflags;
 
-	/* init read buffer */
-	buffer = &sdev->read_buffer;
-	
-	memset(buffer->data, 0x0, sizeof(BLACKMAGIC_SERIAL_BUFFER_SIZE));
-	buffer->available_bytes = 0;
-	buffer->end = buffer->data + BLACKMAGIC_SERIAL_BUFFER_SIZE;
-	buffer->next = buffer->last = buffer->data;
+	blackmagic_synchronize_isr(sdev->ddev);
+
+	spin_lock_irqsave(&sdev->read_lock, iflags);
+		kfifo_reset(&sdev->read_fifo);
+		kfifo_reset(&sdev->rx_batches);
+		sdev->rx_batch_used = 0;
+	spin_unlock_irqrestore(&sdev->read_lock, iflags);
 }
 
-static int blackmagic_serial_open_common(struct blackmagic_serial *sdev, struct tty_struct *tty)
+/*
+ * Empty the write ring of a port that is being opened. write_lock keeps the
+ * writers out; the TX claim is dropped afterwards, as nothing transmits for
+ * a closed port.
+ */
+static void blackmagic_serial_reset_write_buffers(struct blackmagic_serial *sdev)
+{
+	unsigned long iflags;
+
+	spin_lock_irqsave(&sdev->write_lock, iflags);
+		kfifo_reset(&sdev->write_fifo);
+		atomic_set(&sdev->tx_interrupt_pending, 0);
+	spin_unlock_irqrestore(&sdev->write_lock, iflags);
+}
+
+static int blackmagic_serial_open_common(struct blackmagic_serial *sdev, struct tty_struct *tty, enum blackmagic_serial_open_states state)
 {
 	unsigned long iflags;
 	int ret = 0;
 
 	spin_lock_irqsave(&sdev->lock, iflags);
-		ret = test_and_change_open_state(sdev, PORT_CLOSED, tty ? PORT_OPEN_TTY : PORT_OPEN_IOCTL);
+		ret = test_and_change_open_state(sdev, PORT_CLOSED, state);
 		if (ret < 0)
 			goto abort;
-		atomic_set(&sdev->tx_interrupt_pending, 0);
+		/* The library opens the port from inside an ioctl; blackmagic_serial_claim names the file */
+		sdev->opener = (state == PORT_OPEN_IOCTL) ? current : NULL;
+		sdev->owner = NULL;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 8, 0)
 		sdev->tty = tty;
 #endif
 abort:
 	spin_unlock_irqrestore(&sdev->lock, iflags);
 
+	/* The read ring was emptied on close */
+	if (ret == 0)
+		blackmagic_serial_reset_write_buffers(sdev);
+
 	return ret;
 }
 
@@ -129,7 +190,16 @@ int blackmagic_serial_open_ioctl(void *dev)
 	if (IS_ERR(sdev))
 		return PTR_ERR(sdev);
 
-	return blackmagic_serial_open_common(sdev, NULL);
+	return blackmagic_serial_open_common(sdev, NULL, PORT_OPEN_IOCTL);
+}
+
+/* Hand the port to the deck control engine */
+int blackmagic_serial_open_deck(struct blackmagic_device *ddev)
+{
+	if (!ddev->sdev)
+		return -ENODEV;
+
+	return blackmagic_serial_open_common(ddev->sdev, NULL, PORT_OPEN_DECK);
 }
 
 static int blackmagic_serial_open_tty(struct tty_struct *tty, struct file *file)
@@ -141,7 +211,7 @@ static int blackmagic_serial_open_tty(struct tty_struct *tty, struct file *file)
 	if (IS_ERR(sdev))
 		return PTR_ERR(sdev);
 
-	ret = blackmagic_serial_open_common(sdev, tty);
+	ret = blackmagic_serial_open_common(sdev, tty, PORT_OPEN_TTY);
 	if (ret < 0)
 		return ret;
 
@@ -152,6 +222,40 @@ static int blackmagic_serial_open_tty(struct tty_struct *tty, struct file *file)
 #endif
 }
 
+/*
+ * Called after every support library ioctl. If that ioctl opened the port in
+ * IOCTL mode, the port now belongs to filp.
+ */
+void blackmagic_serial_claim(struct blackmagic_device *ddev, struct file *filp)
+{
+	struct blackmagic_serial *sdev;
+	unsigned long iflags;
+
+	if (!ACCESS_ONCE(ddev->sdev))
+		return;
+
+	sdev = serial_get(ddev);
+	if (!sdev)
+		return;
+
+	spin_lock_irqsave(&sdev->lock, iflags);
+		if (sdev->opener == current && sdev->open_state == PORT_OPEN_IOCTL)
+		{
+			sdev->owner = filp;
+			sdev->opener = NULL;
+		}
+	spin_unlock_irqrestore(&sdev->lock, iflags);
+
+	serial_put(ddev, sdev);
+}
+
+/* Whether filp may use the port in IOCTL mode */
+static inline bool serial_owned_by(struct blackmagic_serial *sdev, struct file *filp)
+{
+	return !ACCESS_ONCE(sdev->gone) && ACCESS_ONCE(sdev->open_state) == PORT_OPEN_IOCTL &&
+		ACCESS_ONCE(sdev->owner) == filp;
+}
+
 int blackmagic_serial_port_is_in_use(void *dev)
 {
 	bool in_use = false;
@@ -169,22 +273,33 @@ int blackmagic_serial_port_is_in_use(void *dev)
 	return in_use;
 }
 
-static int blackmagic_serial_close_common(struct blackmagic_serial *sdev, enum blackmagic_serial_open_states state)
+/* With filp set, only close a port that is unowned or owned by filp */
+static int blackmagic_serial_close_common(struct blackmagic_serial *sdev, enum blackmagic_serial_open_states state, struct file *filp)
 {
 	unsigned long iflags;
 	int ret = 0;
 
 	spin_lock_irqsave(&sdev->lock, iflags);
-		ret = test_and_change_open_state(sdev, state, PORT_CLOSED);
+		ret = (filp && sdev->owner && sdev->owner != filp) ? -EBADF :
+			test_and_change_open_state(sdev, state, PORT_CLOSED);
 		if (ret < 0)
 			goto abort;
-		blackmagic_serial_reset_buffers(sdev);
+		if (atomic_read(&sdev->rx_overflow) || atomic_read(&sdev->tx_overflow))
+			dl_info("serial: dropped %d received bytes, refused %d bytes to send\n",
+				atomic_xchg(&sdev->rx_overflow, 0), atomic_xchg(&sdev->tx_overflow, 0));
+		sdev->opener = NULL;
+		sdev->owner = NULL;
+		wake_up_interruptible_all(&sdev->ddev->serial_rx_wait);
+		wake_up_interruptible_all(&sdev->ddev->serial_tx_wait);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 8, 0)
 		sdev->tty = NULL;
 #endif
 abort:
 	spin_unlock_irqrestore(&sdev->lock, iflags);
 
+	if (ret == 0)
+		blackmagic_serial_reset_read_buffers(sdev);
+
 	return ret;
 }
 
@@ -194,7 +309,27 @@ int blackmagic_serial_close_ioctl(void *dev)
 	if (IS_ERR(sdev))
 		return PTR_ERR(sdev);
 
-	return blackmagic_serial_close_common(sdev, PORT_OPEN_IOCTL);
+	return blackmagic_serial_close_common(sdev, PORT_OPEN_IOCTL, NULL);
+}
+
+/*
+ * Close the port if filp owns it in IOCTL mode. A port the library opened
+ * outside an ioctl has no owner and is closed by any file, as before.
+ */
+void blackmagic_serial_release(struct blackmagic_device *ddev, struct file *filp)
+{
+	struct blackmagic_serial *sdev = serial_get(ddev);
+
+	if (!sdev)
+		return;
+
+	blackmagic_serial_close_common(sdev, PORT_OPEN_IOCTL, filp);
+	serial_put(ddev, sdev);
+}
+
+int blackmagic_serial_close_deck(struct blackmagic_device *ddev)
+{
+	return blackmagic_serial_close_common(ddev->sdev, PORT_OPEN_DECK, NULL);
 }
 
 static void blackmagic_serial_close_tty(struct tty_struct *tty, struct file *file)
@@ -203,7 +338,7 @@ static void blackmagic_serial_close_tty(struct tty_struct *tty, struct file *fil
 	if (IS_ERR(sdev))
 		return;
 
-	if (blackmagic_serial_close_common(sdev, PORT_OPEN_TTY) < 0)
+	if (blackmagic_serial_close_common(sdev, PORT_OPEN_TTY, NULL) < 0)
 		return;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 8, 0)
@@ -211,159 +346,275 @@ static void blackmagic_serial_close_tty(struct tty_struct *tty, struct file *fil
 #endif
 }
 
+/* Account for bytes taken from the read ring against the batch records */
+static void blackmagic_serial_consume_batches(struct blackmagic_serial *sdev, unsigned int len)
+{
+	struct blackmagic_serial_rx_batch batch;
+	unsigned int n;
+
+	while (len && kfifo_peek(&sdev->rx_batches, &batch))
+	{
+		n = min(len, batch.bytes - sdev->rx_batch_used);
+		sdev->rx_batch_used += n;
+		len -= n;
+
+		if (sdev->rx_batch_used == batch.bytes)
+		{
+			kfifo_skip(&sdev->rx_batches);
+			sdev->rx_batch_used = 0;
+		}
+	}
+}
+
+/*
+ * Read from the read ring. With a stamp, the read stops at the end of the
+ * oldest batch and returns when that batch was received. The RX interrupt
+ * is the only writer and never takes read_lock.
+ */
+int blackmagic_serial_read_batch(struct blackmagic_serial *sdev, unsigned char *data, int count, struct blackmagic_serial_stamp *stamp)
+{
+	struct blackmagic_serial_rx_batch batch;
+	unsigned long iflags;
+	unsigned int len;
+
+	spin_lock_irqsave(&sdev->read_lock, iflags);
+		if (stamp)
+		{
+			if (kfifo_peek(&sdev->rx_batches, &batch))
+			{
+				*stamp = batch.stamp;
+				count = min_t(int, count, batch.bytes - sdev->rx_batch_used);
+			}
+			else
+				memset(stamp, 0, sizeof(*stamp));
+		}
+		len = kfifo_out(&sdev->read_fifo, data, count);
+		blackmagic_serial_consume_batches(sdev, len);
+	spin_unlock_irqrestore(&sdev->read_lock, iflags);
+
+	return len;
+}
+
 /* Dequeue data from the read buffer - Must be called only when port open in PORT_OPEN_IOCTL mode
  * Called from DaisyCutterDriver
  */
 int blackmagic_serial_dequeue_data(void *dev, unsigned char *data, int count)
 {
 	struct blackmagic_serial *sdev;
-	struct blackmagic_serial_buffer *buffer;
-	unsigned long iflags;
-	int bytes_read = -EBUSY;
 
 	sdev = find_serial_by_ptr(dev);
 	if (IS_ERR(sdev))
 		return 0;
 
-	buffer = &sdev->read_buffer;
+	if (sdev->open_state != PORT_OPEN_IOCTL)
+		return -EBUSY;
+
+	return blackmagic_serial_read_batch(sdev, data, count, NULL);
+}
+
+/* As blackmagic_serial_dequeue_data, but returns bytes from a single RX
+ * batch along with when and in which field they were received
+ */
+int blackmagic_serial_dequeue_data_stamped(void *dev, unsigned char *data, int count, struct blackmagic_serial_stamp *stamp)
+{
+	struct blackmagic_serial *sdev;
 
-	if (!spin_trylock_irqsave(&sdev->lock, iflags))
+	sdev = find_serial_by_ptr(dev);
+	if (IS_ERR(sdev))
 		return 0;
 
 	if (sdev->open_state != PORT_OPEN_IOCTL)
-		goto abort;
+		return -EBUSY;
 
-	bytes_read = 0;
+	return blackmagic_serial_read_batch(sdev, data, count, stamp);
+}
 
-	while (bytes_read < count)
-	{
-		if (buffer->last == buffer->next)
-			break;
+/*
+ * Bulk FIFO access. The support library only exposes per-byte accessors, so
+ * these keep the per-byte calls in one tight loop and let the callers move a
+ * whole batch to the TTY layer or ring buffer at once.
+ */
+static int blackmagic_serial_read_fifo(void *driver, unsigned char *data, int count)
+{
+	int i;
 
-		/* copy byte */
-		*(data++) = *(buffer->last++);
+	for (i = 0; i < count; i++)
+		data[i] = blackmagic_serial_read_byte_priv(driver);
 
-		bytes_read++;
+	return count;
+}
 
-		if (buffer->last >= buffer->end)
-			buffer->last = buffer->data;
-	}
+static void blackmagic_serial_write_fifo(void *driver, const unsigned char *data, int count)
+{
+	int i;
 
-abort:
-	spin_unlock_irqrestore(&sdev->lock, iflags);
-	return bytes_read;
+	for (i = 0; i < count; i++)
+		blackmagic_serial_write_byte_priv(driver, data[i]);
 }
 
 /*
- * Called by on RX interrupt (in hard IRQ context)
+ * Record when a batch arrived. The record is queued before its bytes, so a
+ * reader never finds bytes without one.
+ */
+static bool blackmagic_serial_stamp_batch(struct blackmagic_device *ddev, unsigned int bytes)
+{
+	struct blackmagic_serial_rx_batch batch;
+	unsigned long long field_time;
+
+	batch.stamp.timestamp = dl_uptime();
+	batch.stamp.field = blackmagic_field_clock_read(&ddev->field_clock, &field_time, NULL);
+	batch.stamp.field_offset = (field_time && batch.stamp.timestamp >= field_time) ?
+		min_t(unsigned long long, batch.stamp.timestamp - field_time, UINT_MAX) : 0;
+	batch.bytes = bytes;
+
+	return kfifo_in(&ddev->sdev->rx_batches, &batch, 1);
+}
+
+/*
+ * Called by on RX interrupt (in hard IRQ context). Only drains the HW FIFO
+ * into the read ring; in TTY mode the bytes are passed on to the TTY layer
+ * from blackmagic_serial_rx_work, in deck mode the deck engine parses them.
  */
 void blackmagic_serial_rx_interrupt(void *driver)
 {
-	unsigned long iflags;
+	struct blackmagic_device *ddev;
 	struct blackmagic_serial *sdev;
-	struct blackmagic_serial_buffer *buffer;
+	enum blackmagic_serial_open_states open_state;
+	unsigned char data[BLACKMAGIC_HW_RX_SIZE];
 	int rx_len;
-	int i;
-	unsigned char c;
+	int stored;
+	int len;
 
-	sdev = find_serial_by_ptr(driver);
-	if (IS_ERR(sdev))
+	ddev = blackmagic_find_device_in_isr(driver);
+	if (!ddev || !(ddev->flags & BLACKMAGIC_DEV_HAS_SERIAL))
 		return;
 
-	spin_lock_irqsave(&sdev->lock, iflags);
+	/* Interrupts can arrive before blackmagic_serial_probe has run */
+	sdev = ACCESS_ONCE(ddev->sdev);
+	if (!sdev)
+	{
+		blackmagic_serial_clear_rx_buffer(driver);
+		return;
+	}
 
 	/* The device is not open, clear the interrupt without doing anything */
-	if (sdev->open_state == PORT_CLOSED)
+	open_state = ACCESS_ONCE(sdev->open_state);
+	if (open_state == PORT_CLOSED)
 	{
 		blackmagic_serial_clear_rx_buffer(driver);
-		goto out;
+		return;
 	}
 
 	rx_len = blackmagic_serial_read_len_priv(driver);
 	if (!rx_len)
-		goto out;
+		return;
+
+	while (rx_len > 0)
+	{
+		len = blackmagic_serial_read_fifo(driver, data, min_t(int, rx_len, BLACKMAGIC_HW_RX_SIZE));
+		rx_len -= len;
+
+		// place bytes in read buffer, counting what doesn't fit
+		stored = min_t(int, len, kfifo_avail(&sdev->read_fifo));
+		if (open_state != PORT_OPEN_TTY && stored && !blackmagic_serial_stamp_batch(ddev, stored))
+			stored = 0;
+		kfifo_in(&sdev->read_fifo, data, stored);
+		atomic_add(len - stored, &sdev->rx_overflow);
+	}
+
+	/* Order the ring update before the waiter check; pairs with the waiter's set_current_state */
+	smp_mb();
+	if (open_state == PORT_OPEN_IOCTL && waitqueue_active(&ddev->serial_rx_wait))
+		wake_up_interruptible(&ddev->serial_rx_wait);
 
-	buffer = &sdev->read_buffer;
+	if (open_state == PORT_OPEN_DECK)
+		blackmagic_deck_rx_interrupt(ddev);
 
-	for (i = 0; i < rx_len; i++)
+	if (open_state == PORT_OPEN_TTY)
 	{
-		c = blackmagic_serial_read_byte_priv(driver);
+		atomic_inc(&sdev->rx_work_count);
+		if (!queue_work(blackmagic_serial_wq, &sdev->rx_work))
+			atomic_dec(&sdev->rx_work_count);
+	}
+}
 
-		// check if we are open in IOCTL or TTY mode
-		if (sdev->open_state == PORT_OPEN_TTY)
-		{
-			// opened in TTY mode, pass bytes to the TTY layer
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 8, 0)
-			if (tty_insert_flip_char(sdev->tty, c, TTY_NORMAL) == 0)
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 9, 0)
-			if (tty_insert_flip_char(sdev->port.tty, c, TTY_NORMAL) == 0)
+/*
+ * Pass received bytes on to the TTY layer. Runs from blackmagic_serial_wq so
+ * TTY buffer allocation and flip processing stay out of hard IRQ context.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+static void blackmagic_serial_rx_work(struct work_struct *work)
+{
+	struct blackmagic_serial *sdev = container_of(work, struct blackmagic_serial, rx_work);
 #else
-			if (tty_insert_flip_char(&sdev->port, c, TTY_NORMAL) == 0)
+static void blackmagic_serial_rx_work(void *data)
+{
+	struct blackmagic_serial *sdev = (struct blackmagic_serial *)data;
 #endif
-				break;
-		}
-		else
-		{
-			// opened in IOCTL mode, place bytes in read buffer
-			// dont check if buffer is full, just overwrite previous data
-			*(buffer->next++) = c;
+	unsigned char buf[BLACKMAGIC_HW_RX_SIZE];
+	unsigned int len;
 
-			if (buffer->next >= buffer->end)
-				buffer->next = buffer->data;
+	if (sdev->open_state != PORT_OPEN_TTY)
+		goto out;
 
-		}
+	while ((len = blackmagic_serial_read_batch(sdev, buf, sizeof(buf), NULL)) > 0)
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 8, 0)
+		tty_insert_flip_string(sdev->tty, buf, len);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 9, 0)
+		tty_insert_flip_string(sdev->port.tty, buf, len);
+#else
+		tty_insert_flip_string(&sdev->port, buf, len);
+#endif
 	}
 
-	if (sdev->open_state == PORT_OPEN_TTY)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 8, 0)
-		tty_flip_buffer_push(sdev->tty);
+	tty_flip_buffer_push(sdev->tty);
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 9, 0)
-		tty_flip_buffer_push(sdev->port.tty);
+	tty_flip_buffer_push(sdev->port.tty);
 #else
-		tty_flip_buffer_push(&sdev->port);
+	tty_flip_buffer_push(&sdev->port);
 #endif
 
 out:
-	spin_unlock_irqrestore(&sdev->lock, iflags);
-	return;
+	atomic_dec(&sdev->rx_work_count);
 }
 
 /*
- * Setup a new serial transfer. Caller must hold serial device lock.
+ * Setup a new serial transfer. tx_interrupt_pending doubles as the claim on
+ * the HW, so only one caller loads the FIFO and the write ring has a single
+ * reader without taking a lock.
  */
 static void blackmagic_serial_setup_tx(struct blackmagic_serial *sdev)
 {
-	struct blackmagic_serial_buffer *buffer = &sdev->write_buffer;
 	void *driver = get_driver_from_serial(sdev);
-	int tx_bytes = 0;
-	
-	/* We need to wait until there are no pending interrupts so we don't overwrite
-	   untransmitted data */
-	if (atomic_read(&sdev->tx_interrupt_pending) != 0)
-		return;
-	
-	while (tx_bytes < BLACKMAGIC_HW_TX_SIZE)
-	{
-		if (buffer->last == buffer->next)
-			break;
+	unsigned char data[BLACKMAGIC_HW_TX_SIZE];
+	int tx_bytes;
 
-		/* Write a byte to HW registers */
-		blackmagic_serial_write_byte_priv(driver, *(buffer->last++));
+	for (;;)
+	{
+		/* We need to wait until there are no pending interrupts so we don't overwrite
+		   untransmitted data */
+		if (atomic_cmpxchg(&sdev->tx_interrupt_pending, 0, 1) != 0)
+			return;
 
-		if (buffer->last >= buffer->end)
-			buffer->last = buffer->data;
+		tx_bytes = kfifo_out(&sdev->write_fifo, data, BLACKMAGIC_HW_TX_SIZE);
+		if (tx_bytes)
+			break;
 
-		tx_bytes++;
+		/* Nothing to send. Drop the claim, then make sure a writer didn't add
+		   data and fail to claim the HW in the meantime. */
+		atomic_set(&sdev->tx_interrupt_pending, 0);
+		smp_mb();
+		if (kfifo_is_empty(&sdev->write_fifo))
+			return;
 	}
 
-	if (! tx_bytes)
-		return;
-	
+	/* Write the batch to HW registers */
+	blackmagic_serial_write_fifo(driver, data, tx_bytes);
+
 	/* Set transfer size */
 	blackmagic_serial_write_byte_size_priv(driver, tx_bytes - 1);
-	
-	buffer->available_bytes -= tx_bytes;
-	atomic_set(&sdev->tx_interrupt_pending, 1);
 }
 
 /*
@@ -372,7 +623,6 @@ static void blackmagic_serial_setup_tx(struct blackmagic_serial *sdev)
  */
 void blackmagic_serial_tx_interrupt(void *driver, int continue_tx)
 {
-	unsigned long iflags;
 	struct blackmagic_serial *sdev = NULL;
 	struct tty_struct *tty;
 
@@ -380,31 +630,33 @@ void blackmagic_serial_tx_interrupt(void *driver, int continue_tx)
 	if (IS_ERR(sdev))
 		return;
 
-	spin_lock_irqsave(&sdev->lock, iflags);
+	if (sdev->open_state == PORT_CLOSED)
+		return;
 
-		if (sdev->open_state == PORT_CLOSED)
-			goto abort;
+	atomic_set(&sdev->tx_interrupt_pending, 0);
 
-		atomic_set(&sdev->tx_interrupt_pending, 0);
+	if (continue_tx)
+		blackmagic_serial_setup_tx(sdev);
 
-		if (continue_tx)
-			blackmagic_serial_setup_tx(sdev);
+	smp_mb();
+	if (sdev->open_state == PORT_OPEN_IOCTL && waitqueue_active(&sdev->ddev->serial_tx_wait))
+		wake_up_interruptible(&sdev->ddev->serial_tx_wait);
 
-		/*
-		 * Signal the writer to indicate more room in input buffer, as we have now emptied out
-		 * BLACKMAGIC_HW_TX_SIZE bytes.
-		 */
-		if (sdev->open_state == PORT_OPEN_TTY)
+	/*
+	 * Signal the writer to indicate more room in input buffer, as we have now emptied out
+	 * BLACKMAGIC_HW_TX_SIZE bytes.
+	 */
+	if (sdev->open_state == PORT_OPEN_TTY)
+	{
+		tty = get_tty_from_serial(sdev);
+		if (tty)
 		{
-			tty = get_tty_from_serial(sdev);
 			wake_up(&tty->write_wait);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 8, 0)
 			tty_kref_put(tty);
 #endif
 		}
-
-abort:
-	spin_unlock_irqrestore(&sdev->lock, iflags);
+	}
 }
 
 /* Queue data in the write buffer and send it over the serial port if possible
@@ -413,37 +665,19 @@ abort:
 int blackmagic_serial_enqueue_data(void *dev, const unsigned char *data, int count)
 {
 	struct blackmagic_serial *sdev;
-	struct blackmagic_serial_buffer *buffer;
-	unsigned long iflags;
-	unsigned char *ptr;
-	int write_bytes = 0;
+	int write_bytes;
 
 	sdev = find_serial_by_ptr(dev);
 	if (IS_ERR(sdev))
 		return 0;
-	
-	buffer = &sdev->write_buffer;
-	
-	spin_lock_irqsave(&sdev->lock, iflags);
-	while (write_bytes < count)
-	{
-		ptr = buffer->next + 1;
-		if (ptr >= buffer->end)
-			ptr = buffer->data;
-		
-		/* Buffer is full */
-		if (ptr == buffer->last)
-			break;
-		/* copy data */
-		*buffer->next = *(data++);
-		buffer->next = ptr;
 
-		write_bytes++;
-	}
-	buffer->available_bytes += write_bytes;
+	/* setup_tx is the only reader and never takes write_lock */
+	write_bytes = kfifo_in_spinlocked(&sdev->write_fifo, data, count, &sdev->write_lock);
+	if (write_bytes < count)
+		atomic_add(count - write_bytes, &sdev->tx_overflow);
 
 	if (!write_bytes)
-		goto abort;
+		return 0;
 
 	/*
 	* If the HW is not already transmitting something, start
@@ -451,11 +685,197 @@ int blackmagic_serial_enqueue_data(void *dev, const unsigned char *data, int cou
 	*/
 	blackmagic_serial_setup_tx(sdev);
 
-abort:
-	spin_unlock_irqrestore(&sdev->lock, iflags);
 	return write_bytes;
 }
 
+/*
+ * Blocking transfers for the port in IOCTL mode. Data is staged through a
+ * small kernel buffer so the rings are never accessed with user faults
+ * pending. A transfer returns as soon as some bytes have moved.
+ */
+#define SERIAL_IO_CHUNK		256
+
+static long serial_io_timeout(__u32 timeout_ms)
+{
+	if (timeout_ms == BLACKMAGIC_WAIT_FOREVER)
+		return MAX_SCHEDULE_TIMEOUT;
+	return msecs_to_jiffies(timeout_ms);
+}
+
+static int blackmagic_serial_read_wait(struct blackmagic_serial *sdev, struct file *filp, unsigned char __user *data, int count, long timeout, struct blackmagic_serial_stamp *stamp)
+{
+	void *driver = get_driver_from_serial(sdev);
+	unsigned char buf[SERIAL_IO_CHUNK];
+	int total = 0;
+	int len;
+	long ret;
+
+	while (total < count)
+	{
+		if (!serial_owned_by(sdev, filp))
+			return total ? total : (ACCESS_ONCE(sdev->gone) ? -ENODEV : -EBADF);
+
+		if (stamp)
+			len = blackmagic_serial_dequeue_data_stamped(driver, buf, min_t(int, count - total, sizeof(buf)), stamp);
+		else
+			len = blackmagic_serial_dequeue_data(driver, buf, min_t(int, count - total, sizeof(buf)));
+		if (len < 0)
+			return total ? total : len;
+
+		if (len == 0)
+		{
+			if (total)
+				break;
+			if (!timeout)
+				return -ETIMEDOUT;
+
+			ret = wait_event_interruptible_timeout(sdev->ddev->serial_rx_wait,
+				!kfifo_is_empty(&sdev->read_fifo) || !serial_owned_by(sdev, filp), timeout);
+			if (ret < 0)
+				return ret;
+			timeout = ret;
+			continue;
+		}
+
+		if (copy_to_user(data + total, buf, len))
+			return -EFAULT;
+		total += len;
+
+		/* A stamped read returns one batch at most */
+		if (stamp)
+			break;
+	}
+
+	return total;
+}
+
+static int blackmagic_serial_write_wait(struct blackmagic_serial *sdev, struct file *filp, const unsigned char __user *data, int count, long timeout)
+{
+	void *driver = get_driver_from_serial(sdev);
+	unsigned char buf[SERIAL_IO_CHUNK];
+	int total = 0;
+	int len;
+	long ret;
+
+	while (total < count)
+	{
+		if (!serial_owned_by(sdev, filp))
+			return total ? total : (ACCESS_ONCE(sdev->gone) ? -ENODEV : -EBADF);
+
+		if (kfifo_is_full(&sdev->write_fifo))
+		{
+			if (total)
+				break;
+			if (!timeout)
+				return -ETIMEDOUT;
+
+			ret = wait_event_interruptible_timeout(sdev->ddev->serial_tx_wait,
+				!kfifo_is_full(&sdev->write_fifo) || !serial_owned_by(sdev, filp), timeout);
+			if (ret < 0)
+				return ret;
+			timeout = ret;
+			continue;
+		}
+
+		len = min_t(int, min_t(int, count - total, sizeof(buf)), kfifo_avail(&sdev->write_fifo));
+		if (copy_from_user(buf, data + total, len))
+			return -EFAULT;
+
+		len = blackmagic_serial_enqueue_data(driver, buf, len);
+		if (len <= 0)
+			break;
+		total += len;
+	}
+
+	return total;
+}
+
+static long serial_ioctl(struct blackmagic_serial *sdev, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct blackmagic_serial_stamped_io sio;
+	struct blackmagic_serial_io io;
+	int ret;
+
+	if (cmd == BLACKMAGIC_IOC_SERIAL_READ_STAMPED)
+	{
+		if (copy_from_user(&sio, (void __user *)arg, sizeof(sio)))
+			return -EFAULT;
+		if ((int)sio.io.count < 0)
+			return -EINVAL;
+
+		ret = blackmagic_serial_read_wait(sdev, filp, (unsigned char __user *)(unsigned long)sio.io.data,
+			sio.io.count, serial_io_timeout(sio.io.timeout_ms), &sio.stamp);
+		if (ret > 0 && copy_to_user(&((struct blackmagic_serial_stamped_io __user *)arg)->stamp, &sio.stamp, sizeof(sio.stamp)))
+			return -EFAULT;
+		return ret;
+	}
+
+	if (copy_from_user(&io, (void __user *)arg, sizeof(io)))
+		return -EFAULT;
+
+	if ((int)io.count < 0)
+		return -EINVAL;
+
+	switch (cmd)
+	{
+		case BLACKMAGIC_IOC_SERIAL_READ:
+			return blackmagic_serial_read_wait(sdev, filp,
+				(unsigned char __user *)(unsigned long)io.data, io.count, serial_io_timeout(io.timeout_ms), NULL);
+		case BLACKMAGIC_IOC_SERIAL_WRITE:
+			return blackmagic_serial_write_wait(sdev, filp,
+				(const unsigned char __user *)(unsigned long)io.data, io.count, serial_io_timeout(io.timeout_ms));
+	}
+
+	return -ENOTTY;
+}
+
+long blackmagic_serial_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct blackmagic_serial *sdev;
+	long ret;
+
+	sdev = serial_get(ddev);
+	if (!sdev)
+		return -ENODEV;
+
+	ret = serial_ioctl(sdev, filp, cmd, arg);
+	serial_put(ddev, sdev);
+
+	return ret;
+}
+
+/*
+ * Poll support for the owner of the port in IOCTL mode. POLLIN/POLLOUT already report
+ * video frames, so serial data and write room are reported as the
+ * POLLRDBAND and POLLWRBAND bands.
+ */
+unsigned int blackmagic_serial_poll(struct blackmagic_device *ddev, struct file *filp, poll_table *wait)
+{
+	struct blackmagic_serial *sdev;
+	unsigned int mask = 0;
+
+	if (!ACCESS_ONCE(ddev->sdev))
+		return 0;
+
+	sdev = serial_get(ddev);
+	if (!sdev)
+		return 0;
+
+	if (serial_owned_by(sdev, filp))
+	{
+		poll_wait(filp, &ddev->serial_rx_wait, wait);
+		poll_wait(filp, &ddev->serial_tx_wait, wait);
+
+		if (!kfifo_is_empty(&sdev->read_fifo))
+			mask |= POLLRDBAND;
+		if (!kfifo_is_full(&sdev->write_fifo))
+			mask |= POLLWRBAND;
+	}
+
+	serial_put(ddev, sdev);
+	return mask;
+}
+
 static int blackmagic_serial_write(struct tty_struct *tty,
 		      const unsigned char *data, int count)
 {
@@ -472,10 +892,7 @@ static int blackmagic_serial_write(struct tty_struct *tty,
 
 static int blackmagic_serial_write_room(struct tty_struct *tty)
 {
-	unsigned long iflags;
 	struct blackmagic_serial *sdev = find_serial_by_tty(tty);
-	struct blackmagic_serial_buffer *buffer;
-	int room = 0;
 
 	if (IS_ERR(sdev) || sdev->open_state == PORT_CLOSED)
 		return -ENODEV;
@@ -483,20 +900,12 @@ static int blackmagic_serial_write_room(struct tty_struct *tty)
 	if (sdev->open_state == PORT_OPEN_IOCTL)
 		return -EBUSY;
 
-	buffer = &sdev->write_buffer;
-
-	spin_lock_irqsave(&sdev->lock, iflags);
-	room = BLACKMAGIC_SERIAL_BUFFER_SIZE - 1 - buffer->available_bytes;
-	spin_unlock_irqrestore(&sdev->lock, iflags);
-
-	return room;
+	return kfifo_avail(&sdev->write_fifo);
 }
 
 static int blackmagic_serial_chars_in_buffer(struct tty_struct *tty)
 {
-	unsigned long iflags;
 	struct blackmagic_serial *sdev = find_serial_by_tty(tty);
-	int chars = 0;
 
 	if (IS_ERR(sdev) || sdev->open_state == PORT_CLOSED)
 		return -ENODEV;
@@ -504,11 +913,7 @@ static int blackmagic_serial_chars_in_buffer(struct tty_struct *tty)
 	if (sdev->open_state == PORT_OPEN_IOCTL)
 		return -EBUSY;
 
-	spin_lock_irqsave(&sdev->lock, iflags);
-	chars = sdev->write_buffer.available_bytes;
-	spin_unlock_irqrestore(&sdev->lock, iflags);
-
-	return chars;
+	return kfifo_len(&sdev->write_fifo);
 }
 
 static struct tty_operations blackmagic_tty_ops =
@@ -550,22 +955,71 @@ int blackmagic_serial_port_path(void* dev, char *buffer, int len)
 	return 0;
 }
 
+/*
+ * Unpublish the port, wake its sleepers and wait until the RX interrupt and
+ * every client call are done with it. The wait queues live in ddev, so poll
+ * entries left on them stay valid once sdev is freed.
+ */
+static void serial_unpublish(struct blackmagic_device *ddev, struct blackmagic_serial *sdev)
+{
+	unsigned long iflags;
+
+	spin_lock_irqsave(&ddev->serial_lock, iflags);
+		sdev->gone = true;
+		ddev->sdev = NULL;
+	spin_unlock_irqrestore(&ddev->serial_lock, iflags);
+
+	blackmagic_synchronize_isr(ddev);
+
+	wake_up_interruptible_all(&ddev->serial_rx_wait);
+	wake_up_interruptible_all(&ddev->serial_tx_wait);
+	wait_event(ddev->serial_rx_wait, atomic_read(&sdev->users) == 0);
+}
+
 int blackmagic_serial_probe(struct blackmagic_device *ddev, struct device *dev)
 {
-	struct blackmagic_serial *sdev = &ddev->sdev;
+	struct blackmagic_serial *sdev;
 	void *tty_dev;
 
-	if (ddev->id > BLACKMAGIC_SERIAL_MINORS)
+	int ret;
+
+	if (ddev->id < 0 || ddev->id >= BLACKMAGIC_SERIAL_MINORS)
 		return -ERANGE;
 
+	sdev = kzalloc(sizeof(struct blackmagic_serial), GFP_KERNEL);
+	if (!sdev)
+		return -ENOMEM;
+
+	sdev->ddev = ddev;
 	spin_lock_init(&sdev->lock);
+	spin_lock_init(&sdev->write_lock);
+	spin_lock_init(&sdev->read_lock);
 	sdev->open_state = PORT_CLOSED;
+	atomic_set(&sdev->tx_interrupt_pending, 0);
+	atomic_set(&sdev->rx_overflow, 0);
+	atomic_set(&sdev->tx_overflow, 0);
+	atomic_set(&sdev->rx_work_count, 0);
+	INIT_KFIFO(sdev->rx_batches);
+	sdev->rx_batch_used = 0;
+	atomic_set(&sdev->users, 0);
+	sdev->gone = false;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 8, 0)
 	sdev->tty = NULL;
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+	INIT_WORK(&sdev->rx_work, blackmagic_serial_rx_work);
+#else
+	INIT_WORK(&sdev->rx_work, blackmagic_serial_rx_work, sdev);
+#endif
 
 	/* init our ring buffers */
-	blackmagic_serial_reset_buffers(sdev);
+	ret = kfifo_alloc(&sdev->write_fifo, blackmagic_serial_buffer_size, GFP_KERNEL);
+	if (ret)
+		goto fail_write;
+
+	ret = kfifo_alloc(&sdev->read_fifo, blackmagic_serial_buffer_size, GFP_KERNEL);
+	if (ret)
+		goto fail_read;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 8, 0)
 	tty_port_init(&sdev->port);
@@ -573,13 +1027,25 @@ int blackmagic_serial_probe(struct blackmagic_device *ddev, struct device *dev)
 	sdev->port.ops = &blackmagic_tty_port_ops;
 #endif
 
+	/* Publish the port before it can be opened */
+	smp_wmb();
+	ddev->sdev = sdev;
+
 	tty_dev = tty_register_device(blackmagic_tty_driver, ddev->id, dev);
 	if (IS_ERR(tty_dev))
 	{
+		ret = PTR_ERR(tty_dev);
+		serial_unpublish(ddev, sdev);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 8, 0)
+		blackmagic_tty_driver->ports[ddev->id] = NULL;
 		tty_port_destroy(&sdev->port);
 #endif
-		return PTR_ERR(tty_dev);
+		kfifo_free(&sdev->read_fifo);
+fail_read:
+		kfifo_free(&sdev->write_fifo);
+fail_write:
+		kfree(sdev);
+		return ret;
 	}
 
 	return 0;
@@ -587,10 +1053,25 @@ int blackmagic_serial_probe(struct blackmagic_device *ddev, struct device *dev)
 
 void blackmagic_serial_remove(struct blackmagic_device *ddev)
 {
+	struct blackmagic_serial *sdev = ddev->sdev;
+
+	if (!sdev)
+		return;
+
 	tty_unregister_device(blackmagic_tty_driver, ddev->id);
+
+	serial_unpublish(ddev, sdev);
+
+	while (atomic_read(&sdev->rx_work_count))
+		schedule(); // Wait until RX work is complete
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 8, 0)
-	tty_port_destroy(&ddev->sdev.port);
+	blackmagic_tty_driver->ports[ddev->id] = NULL;
+	tty_port_destroy(&sdev->port);
 #endif
+	kfifo_free(&sdev->read_fifo);
+	kfifo_free(&sdev->write_fifo);
+	kfree(sdev);
 }
 
 int __init blackmagic_serial_init(void)
@@ -598,9 +1079,20 @@ int __init blackmagic_serial_init(void)
 	int ret;
 	struct tty_driver *driver;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	blackmagic_serial_wq = alloc_workqueue("bmd-serial", WQ_HIGHPRI, 0);
+#else
+	blackmagic_serial_wq = create_singlethread_workqueue("bmd-serial");
+#endif
+	if (!blackmagic_serial_wq)
+		return -ENOMEM;
+
 	driver = alloc_tty_driver(BLACKMAGIC_SERIAL_MINORS);
 	if (!driver)
+	{
+		destroy_workqueue(blackmagic_serial_wq);
 		return -ENOMEM;
+	}
 
 	driver->owner = THIS_MODULE;
 	driver->driver_name = "blackmagic_serial";
@@ -625,6 +1117,7 @@ int __init blackmagic_serial_init(void)
 abort:
 	printk(KERN_ERR "failed to register blackmagic serial driver");
 	put_tty_driver(driver);
+	destroy_workqueue(blackmagic_serial_wq);
 	return ret;
 }
 
@@ -635,4 +1128,5 @@ void __exit blackmagic_serial_exit(void)
 		tty_unregister_driver(blackmagic_tty_driver);
 		put_tty_driver(blackmagic_tty_driver);
 	}
+	destroy_workqueue(blackmagic_serial_wq);
 }
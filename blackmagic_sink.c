@@ -0,0 +1,409 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	#include <linux/uio.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	#include <linux/bvec.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	#include <linux/blk_types.h>
+#endif
+#include "blackmagic_sink.h"
+#include "blackmagic_fanout.h"
+
+/* Serialises publishing ddev->sink and taking users on it; never held while stopping */
+static DEFINE_MUTEX(blackmagic_sink_mutex);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+
+static int sink_grow_bvec(struct blackmagic_sink *sink, unsigned long nr_pages)
+{
+	struct bio_vec *bvec;
+
+	if (nr_pages <= sink->bvec_size)
+		return 0;
+
+	bvec = kmalloc(nr_pages * sizeof(*bvec), GFP_KERNEL);
+	if (!bvec)
+		return -ENOMEM;
+
+	kfree(sink->bvec);
+	sink->bvec = bvec;
+	sink->bvec_size = nr_pages;
+	return 0;
+}
+
+/* Write the frame straight from its pinned pages */
+static ssize_t sink_write_frame(struct blackmagic_sink *sink, struct blackmagic_fanout_frame *frame)
+{
+	struct iov_iter iter;
+	unsigned long offset = offset_in_page(frame->addr);
+	unsigned long left = frame->length;
+	unsigned long i;
+	int ret;
+
+	ret = sink_grow_bvec(sink, frame->nr_pages);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < frame->nr_pages && left; i++)
+	{
+		sink->bvec[i].bv_page = frame->pages[i];
+		sink->bvec[i].bv_offset = offset;
+		sink->bvec[i].bv_len = min(left, PAGE_SIZE - offset);
+		left -= sink->bvec[i].bv_len;
+		offset = 0;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	iov_iter_bvec(&iter, WRITE, sink->bvec, i, frame->length);
+#else
+	iov_iter_bvec(&iter, ITER_BVEC | WRITE, sink->bvec, i, frame->length);
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	return vfs_iter_write(sink->file, &iter, &sink->pos, 0);
+#else
+	return vfs_iter_write(sink->file, &iter, &sink->pos);
+#endif
+}
+
+static int blackmagic_sink_thread(void *data)
+{
+	struct blackmagic_sink *sink = (struct blackmagic_sink *)data;
+	struct blackmagic_fanout *fanout = sink->ddev->fanout;
+	struct blackmagic_capture_completion c;
+	struct blackmagic_fanout_record record;
+	struct blackmagic_fanout_frame *frame;
+	unsigned long long start;
+	unsigned long events;
+	ssize_t written;
+
+	while (!kthread_should_stop())
+	{
+		events = blackmagic_fanout_events(fanout);
+
+		while (!kthread_should_stop() && blackmagic_fanout_next(fanout, sink->file, &record, &frame))
+		{
+			c.seq = record.seq;
+			c.cookie = record.cookie;
+			c.timestamp = record.timestamp;
+			c.file_offset = sink->pos;
+
+			start = dl_uptime();
+			written = sink_write_frame(sink, frame);
+			c.write_us = (__u32)div_u64(dl_uptime() - start, NSEC_PER_USEC);
+			c.length = written > 0 ? written : 0;
+			c.status = written < 0 ? (__s32)written : (written < frame->length ? -EIO : 0);
+
+			/* The frame goes back to the publisher once written */
+			blackmagic_fanout_put_frame(frame);
+			blackmagic_fanout_release_frame(fanout, sink->file, record.seq);
+
+			if (!kfifo_in_spinlocked(&sink->done, &c, 1, &sink->lock))
+				atomic_inc(&sink->done_overflow);
+			wake_up_interruptible(&sink->ddev->sink_wait);
+		}
+
+		wait_event_interruptible(fanout->record_wait,
+			kthread_should_stop() || blackmagic_fanout_events(fanout) != events);
+	}
+
+	return 0;
+}
+
+static int blackmagic_sink_start(struct blackmagic_device *ddev, struct file *filp, const struct blackmagic_capture_sink *config)
+{
+	struct blackmagic_sink *sink;
+	struct file *file;
+	int ret;
+
+	if (!ddev->fanout)
+		return -ENODEV;
+
+	file = fget(config->fd);
+	if (!file)
+		return -EBADF;
+
+	if (!(file->f_mode & FMODE_WRITE) || !S_ISREG(file_inode(file)->i_mode))
+	{
+		fput(file);
+		return -EINVAL;
+	}
+
+	sink = kzalloc(sizeof(*sink), GFP_KERNEL);
+	if (!sink)
+	{
+		fput(file);
+		return -ENOMEM;
+	}
+
+	sink->ddev = ddev;
+	sink->owner = filp;
+	sink->file = file;
+	sink->pos = config->offset;
+	atomic_set(&sink->users, 0);
+	spin_lock_init(&sink->lock);
+	INIT_KFIFO(sink->done);
+	atomic_set(&sink->done_overflow, 0);
+
+	mutex_lock(&blackmagic_sink_mutex);
+	if (ddev->sink)
+	{
+		ret = -EBUSY;
+		goto fail;
+	}
+
+	ret = blackmagic_fanout_subscribe(ddev->fanout, file, true);
+	if (ret < 0)
+		goto fail;
+
+	sink->thread = kthread_run(blackmagic_sink_thread, sink, "bmd-sink/%d", ddev->id);
+	if (IS_ERR(sink->thread))
+	{
+		ret = PTR_ERR(sink->thread);
+		blackmagic_fanout_subscribe(ddev->fanout, file, false);
+		goto fail;
+	}
+
+	ddev->sink = sink;
+	mutex_unlock(&blackmagic_sink_mutex);
+	return 0;
+
+fail:
+	mutex_unlock(&blackmagic_sink_mutex);
+	fput(file);
+	kfree(sink);
+	return ret;
+}
+
+/*
+ * Unpublish the sink if filp owns it, or whoever owns it with a NULL filp.
+ * Stopping happens after blackmagic_sink_mutex is dropped, so a thread stuck
+ * in a slow write does not hold up the other devices.
+ */
+static struct blackmagic_sink *blackmagic_sink_detach(struct blackmagic_device *ddev, struct file *filp)
+{
+	struct blackmagic_sink *sink;
+
+	mutex_lock(&blackmagic_sink_mutex);
+	sink = ddev->sink;
+	if (sink && (!filp || sink->owner == filp))
+		ddev->sink = NULL;
+	else
+		sink = NULL;
+	mutex_unlock(&blackmagic_sink_mutex);
+
+	return sink;
+}
+
+static void blackmagic_sink_stop(struct blackmagic_device *ddev, struct blackmagic_sink *sink)
+{
+	kthread_stop(sink->thread);
+
+	/* Frames still queued for the sink go back to the publisher unwritten */
+	if (ddev->fanout)
+		blackmagic_fanout_subscribe(ddev->fanout, sink->file, false);
+
+	/* Wait until clients inside blackmagic_sink_complete have left */
+	sink->closing = true;
+	wake_up_interruptible_all(&ddev->sink_wait);
+	wait_event(ddev->sink_wait, atomic_read(&sink->users) == 0);
+
+	if (atomic_read(&sink->done_overflow))
+		dl_info("capture sink: dropped %d uncollected completions\n", atomic_read(&sink->done_overflow));
+
+	fput(sink->file);
+	kfree(sink->bvec);
+	kfree(sink);
+}
+
+static bool sink_done_ready(struct blackmagic_sink *sink)
+{
+	return !kfifo_is_empty(&sink->done) || sink->closing;
+}
+
+static int blackmagic_sink_complete(struct blackmagic_device *ddev, struct file *filp, const struct blackmagic_fanout_wait *wait)
+{
+	struct blackmagic_capture_completion __user *dst = (struct blackmagic_capture_completion __user *)(unsigned long)wait->records;
+	struct blackmagic_capture_completion c;
+	struct blackmagic_sink *sink;
+	long timeout;
+	int total = 0;
+	int ret = 0;
+
+	mutex_lock(&blackmagic_sink_mutex);
+	sink = ddev->sink;
+	if (sink && sink->owner == filp)
+		atomic_inc(&sink->users);
+	else
+		sink = NULL;
+	mutex_unlock(&blackmagic_sink_mutex);
+
+	if (!sink)
+		return -EBADF;
+
+	if (wait->timeout_ms == BLACKMAGIC_WAIT_FOREVER)
+		timeout = MAX_SCHEDULE_TIMEOUT;
+	else
+		timeout = msecs_to_jiffies(wait->timeout_ms);
+
+	if (kfifo_is_empty(&sink->done) && timeout)
+	{
+		ret = wait_event_interruptible_timeout(ddev->sink_wait, sink_done_ready(sink), timeout);
+		if (ret < 0)
+			goto out;
+	}
+
+	while (total < wait->count && kfifo_out_spinlocked(&sink->done, &c, 1, &sink->lock))
+	{
+		if (copy_to_user(dst + total, &c, sizeof(c)))
+		{
+			ret = -EFAULT;
+			goto out;
+		}
+		total++;
+	}
+
+	ret = total ? total : -ETIMEDOUT;
+
+out:
+	/* The sink may be freed as soon as users drops to zero */
+	if (atomic_dec_and_test(&sink->users))
+		wake_up_all(&ddev->sink_wait);
+	return ret;
+}
+
+long blackmagic_sink_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct blackmagic_capture_sink config;
+	struct blackmagic_fanout_wait wait;
+	struct blackmagic_sink *sink;
+
+	switch (cmd)
+	{
+		case BLACKMAGIC_IOC_CAPTURE_SINK_START:
+			if (copy_from_user(&config, (void __user *)arg, sizeof(config)))
+				return -EFAULT;
+			return blackmagic_sink_start(ddev, filp, &config);
+
+		case BLACKMAGIC_IOC_CAPTURE_SINK_STOP:
+			sink = blackmagic_sink_detach(ddev, filp);
+			if (!sink)
+				return -EBADF;
+			blackmagic_sink_stop(ddev, sink);
+			return 0;
+
+		case BLACKMAGIC_IOC_CAPTURE_SINK_COMPLETE:
+			if (copy_from_user(&wait, (void __user *)arg, sizeof(wait)))
+				return -EFAULT;
+			return blackmagic_sink_complete(ddev, filp, &wait);
+	}
+
+	return -ENOTTY;
+}
+
+/*
+ * Completions are reported as POLLPRI, like fan-out records.
+ */
+unsigned int blackmagic_sink_poll(struct blackmagic_device *ddev, struct file *filp, poll_table *wait)
+{
+	struct blackmagic_sink *sink;
+	unsigned int mask = 0;
+
+	mutex_lock(&blackmagic_sink_mutex);
+	sink = ddev->sink;
+	if (sink && sink->owner == filp)
+	{
+		poll_wait(filp, &ddev->sink_wait, wait);
+		if (!kfifo_is_empty(&sink->done))
+			mask |= POLLPRI;
+	}
+	mutex_unlock(&blackmagic_sink_mutex);
+
+	return mask;
+}
+
+#else
+
+/* vfs_iter_write and bvec iterators arrived in 4.1 */
+long blackmagic_sink_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	return -EOPNOTSUPP;
+}
+
+unsigned int blackmagic_sink_poll(struct blackmagic_device *ddev, struct file *filp, poll_table *wait)
+{
+	return 0;
+}
+
+static struct blackmagic_sink *blackmagic_sink_detach(struct blackmagic_device *ddev, struct file *filp)
+{
+	return NULL;
+}
+
+static void blackmagic_sink_stop(struct blackmagic_device *ddev, struct blackmagic_sink *sink)
+{
+}
+
+#endif
+
+/*
+ * Stop the sink when the device goes away, whoever owns it.
+ */
+void blackmagic_sink_remove(struct blackmagic_device *ddev)
+{
+	struct blackmagic_sink *sink = blackmagic_sink_detach(ddev, NULL);
+
+	if (sink)
+		blackmagic_sink_stop(ddev, sink);
+}
+
+/*
+ * The sink belongs to the file that started it.
+ */
+void blackmagic_sink_release(struct blackmagic_device *ddev, struct file *filp)
+{
+	struct blackmagic_sink *sink = blackmagic_sink_detach(ddev, filp);
+
+	if (sink)
+		blackmagic_sink_stop(ddev, sink);
+}
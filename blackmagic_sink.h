@@ -0,0 +1,69 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+
+#ifndef BLACKMAGIC_SINK_H
+#define BLACKMAGIC_SINK_H
+
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include "blackmagic_core.h"
+#include "blackmagic_ioctl.h"
+
+#define BLACKMAGIC_SINK_DONE_SIZE		64
+
+struct bio_vec;
+
+/*
+ * Capture-to-file sink. One per device, owned by the client that started it.
+ * Its thread is an in-kernel fan-out subscriber keyed by the output file.
+ */
+struct blackmagic_sink
+{
+	struct blackmagic_device *ddev;
+	struct file *owner;
+	struct file *file;
+	struct task_struct *thread;
+	bool closing;
+	loff_t pos;
+	atomic_t users;							/* Clients inside blackmagic_sink_complete */
+
+	struct bio_vec *bvec;					/* Thread only, grown as needed */
+	unsigned long bvec_size;
+
+	spinlock_t lock;						/* Protects done */
+	DECLARE_KFIFO(done, struct blackmagic_capture_completion, BLACKMAGIC_SINK_DONE_SIZE);
+	atomic_t done_overflow;					/* Clients wait on ddev->sink_wait */
+};
+
+long blackmagic_sink_ioctl(struct blackmagic_device *ddev, struct file *filp, unsigned int cmd, unsigned long arg);
+unsigned int blackmagic_sink_poll(struct blackmagic_device *ddev, struct file *filp, poll_table *wait);
+void blackmagic_sink_release(struct blackmagic_device *ddev, struct file *filp);
+void blackmagic_sink_remove(struct blackmagic_device *ddev);
+
+#endif
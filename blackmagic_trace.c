@@ -0,0 +1,355 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <asm/local.h>
+#include "blackmagic_lib.h"
+#include "blackmagic_trace.h"
+
+#define BLACKMAGIC_TRACE_RECORDS	1024	/* Per CPU, must be a power of two */
+
+enum {
+	TRACE_CONTEXT_TASK = 0,
+	TRACE_CONTEXT_SOFTIRQ,
+	TRACE_CONTEXT_HARDIRQ,
+};
+
+struct blackmagic_trace_buffer
+{
+	local_t head;
+	struct blackmagic_trace_record records[BLACKMAGIC_TRACE_RECORDS];
+};
+
+bool blackmagic_trace_enable = true;
+module_param(blackmagic_trace_enable, bool, S_IRUGO | S_IWUSR);
+
+/*
+ * Recording stops while this is non-zero. dl_trace_freeze holds one count,
+ * and every dump or clear of the trace holds another while it runs.
+ */
+atomic_t blackmagic_trace_frozen = ATOMIC_INIT(0);
+static atomic_t trace_user_frozen = ATOMIC_INIT(0);
+
+static DEFINE_PER_CPU(struct blackmagic_trace_buffer *, blackmagic_trace_buffers);
+struct proc_dir_entry *blackmagic_proc_dir = NULL;
+static struct proc_dir_entry *blackmagic_trace_entry = NULL;
+
+static const char *trace_type_names[BLACKMAGIC_TRACE_MAX] = {
+	[BLACKMAGIC_TRACE_NONE]					= "none",
+	[BLACKMAGIC_TRACE_ISR]					= "isr",
+	[BLACKMAGIC_TRACE_TASKLET]				= "tasklet",
+	[BLACKMAGIC_TRACE_WORK]					= "work",
+	[BLACKMAGIC_TRACE_GATE_LOCK]			= "gate-lock",
+	[BLACKMAGIC_TRACE_GATE_LOCK_INTERRUPT]	= "gate-lock-irq",
+	[BLACKMAGIC_TRACE_GATE_UNLOCK]			= "gate-unlock",
+	[BLACKMAGIC_TRACE_GATE_HANDOFF]			= "gate-handoff",
+	[BLACKMAGIC_TRACE_DMA_MAP]				= "dma-map",
+	[BLACKMAGIC_TRACE_DMA_UNMAP]			= "dma-unmap",
+	[BLACKMAGIC_TRACE_FREEZE]				= "freeze",
+};
+
+static const char *trace_context_names[] = { "task", "softirq", "hardirq" };
+
+/*
+ * Claim the next slot of this CPU's ring. Slots are claimed with a local
+ * increment, so a record written from an interrupt that nests inside another
+ * write simply takes the following slot; nothing is locked or disabled.
+ */
+void __blackmagic_trace(unsigned int type, unsigned int arg, unsigned long long data)
+{
+	struct blackmagic_trace_buffer *buffer;
+	struct blackmagic_trace_record *rec;
+	long idx;
+
+	buffer = get_cpu_var(blackmagic_trace_buffers);
+	if (!buffer)
+		goto out;
+
+	idx = local_inc_return(&buffer->head) - 1;
+	rec = &buffer->records[idx & (BLACKMAGIC_TRACE_RECORDS - 1)];
+
+	rec->timestamp = dl_uptime();
+	rec->data = data;
+	rec->arg = arg;
+	rec->type = type;
+	rec->context = in_irq() ? TRACE_CONTEXT_HARDIRQ : (in_interrupt() ? TRACE_CONTEXT_SOFTIRQ : TRACE_CONTEXT_TASK);
+
+out:
+	put_cpu_var(blackmagic_trace_buffers);
+}
+
+/*
+ * Stop recording so the preceding history is kept for inspection. Intended to
+ * be called when a late frame is detected.
+ */
+void dl_trace_freeze(void)
+{
+	blackmagic_trace(BLACKMAGIC_TRACE_FREEZE, current->pid, 0);
+	if (!atomic_xchg(&trace_user_frozen, 1))
+		atomic_inc(&blackmagic_trace_frozen);
+}
+
+void dl_trace_thaw(void)
+{
+	if (atomic_xchg(&trace_user_frozen, 0))
+		atomic_dec(&blackmagic_trace_frozen);
+}
+
+static void trace_clear_buffer(struct blackmagic_trace_buffer *buffer)
+{
+	memset(buffer->records, 0, sizeof(buffer->records));
+	local_set(&buffer->head, 0);
+}
+
+/* Runs on each online CPU, so head is only ever changed by its own CPU */
+static void trace_clear_local(void *unused)
+{
+	struct blackmagic_trace_buffer *buffer = __this_cpu_read(blackmagic_trace_buffers);
+
+	if (buffer)
+		trace_clear_buffer(buffer);
+}
+
+static void blackmagic_trace_clear(void)
+{
+	int cpu;
+	struct blackmagic_trace_buffer *buffer;
+
+	atomic_inc(&blackmagic_trace_frozen);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
+	on_each_cpu(trace_clear_local, NULL, 1);
+#else
+	on_each_cpu(trace_clear_local, NULL, 0, 1);
+#endif
+
+	// Nothing records on an offline CPU
+	for_each_possible_cpu(cpu)
+	{
+		buffer = per_cpu(blackmagic_trace_buffers, cpu);
+		if (buffer && !cpu_online(cpu))
+			trace_clear_buffer(buffer);
+	}
+
+	atomic_dec(&blackmagic_trace_frozen);
+}
+
+/*
+ * The seq_file position walks every slot of every possible CPU, oldest first
+ * within each CPU. Unused slots are skipped by the show function. Recording
+ * is stopped while the file is open, and each CPU's head is read once at open,
+ * so the whole dump is taken from the same point in every ring.
+ */
+static void *trace_seq_start(struct seq_file *m, loff_t *pos)
+{
+	if (*pos >= (loff_t)nr_cpu_ids * BLACKMAGIC_TRACE_RECORDS)
+		return NULL;
+	return pos;
+}
+
+static void *trace_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return trace_seq_start(m, pos);
+}
+
+static void trace_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+static int trace_seq_show(struct seq_file *m, void *v)
+{
+	loff_t pos = *(loff_t *)v;
+	int cpu = pos / BLACKMAGIC_TRACE_RECORDS;
+	unsigned int slot = pos % BLACKMAGIC_TRACE_RECORDS;
+	long *heads = m->private;
+	struct blackmagic_trace_buffer *buffer;
+	struct blackmagic_trace_record rec;
+	unsigned long long ts;
+
+	if (pos == 0)
+		seq_printf(m, "# frozen: %d\n# cpu timestamp(ns) context event arg data\n",
+			atomic_read(&trace_user_frozen));
+
+	if (!cpu_possible(cpu))
+		return 0;
+
+	buffer = per_cpu(blackmagic_trace_buffers, cpu);
+	if (!buffer)
+		return 0;
+
+	slot = (heads[cpu] + slot) & (BLACKMAGIC_TRACE_RECORDS - 1);
+	rec = buffer->records[slot];
+	if (rec.type == BLACKMAGIC_TRACE_NONE || rec.type >= BLACKMAGIC_TRACE_MAX)
+		return 0;
+
+	ts = rec.timestamp;
+	seq_printf(m, "%3d %llu.%09llu %-7s %-13s %#x %#llx\n",
+		cpu, dl_div64(ts, 1000000000ULL), dl_mod64(ts, 1000000000ULL),
+		trace_context_names[rec.context], trace_type_names[rec.type],
+		rec.arg, rec.data);
+
+	return 0;
+}
+
+static struct seq_operations trace_seq_ops = {
+	.start = trace_seq_start,
+	.next = trace_seq_next,
+	.stop = trace_seq_stop,
+	.show = trace_seq_show,
+};
+
+static int trace_proc_open(struct inode *inode, struct file *file)
+{
+	struct blackmagic_trace_buffer *buffer;
+	long *heads;
+	int cpu, ret;
+
+	heads = kcalloc(nr_cpu_ids, sizeof(long), GFP_KERNEL);
+	if (!heads)
+		return -ENOMEM;
+
+	ret = seq_open(file, &trace_seq_ops);
+	if (ret)
+	{
+		kfree(heads);
+		return ret;
+	}
+
+	atomic_inc(&blackmagic_trace_frozen);
+	for_each_possible_cpu(cpu)
+	{
+		buffer = per_cpu(blackmagic_trace_buffers, cpu);
+		if (buffer)
+			heads[cpu] = local_read(&buffer->head);
+	}
+	((struct seq_file *)file->private_data)->private = heads;
+
+	return 0;
+}
+
+static int trace_proc_release(struct inode *inode, struct file *file)
+{
+	kfree(((struct seq_file *)file->private_data)->private);
+	atomic_dec(&blackmagic_trace_frozen);
+	return seq_release(inode, file);
+}
+
+/*
+ * Accepts "freeze", "thaw" and "clear".
+ */
+static ssize_t trace_proc_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	char cmd[16];
+	size_t len = min(count, sizeof(cmd) - 1);
+
+	if (copy_from_user(cmd, ubuf, len))
+		return -EFAULT;
+	cmd[len] = '\0';
+
+	if (!strncmp(cmd, "freeze", 6))
+		dl_trace_freeze();
+	else if (!strncmp(cmd, "thaw", 4))
+		dl_trace_thaw();
+	else if (!strncmp(cmd, "clear", 5))
+		blackmagic_trace_clear();
+	else
+		return -EINVAL;
+
+	return count;
+}
+
+static struct file_operations trace_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = trace_proc_open,
+	.read = seq_read,
+	.write = trace_proc_write,
+	.llseek = seq_lseek,
+	.release = trace_proc_release,
+};
+
+int blackmagic_trace_init(void)
+{
+	int cpu;
+	struct blackmagic_trace_buffer *buffer;
+
+	for_each_possible_cpu(cpu)
+	{
+		buffer = kzalloc_node(sizeof(struct blackmagic_trace_buffer), GFP_KERNEL, cpu_to_node(cpu));
+		if (!buffer)
+			goto fail;
+		local_set(&buffer->head, 0);
+		per_cpu(blackmagic_trace_buffers, cpu) = buffer;
+	}
+
+	blackmagic_proc_dir = proc_mkdir("driver/blackmagic", NULL);
+	if (!blackmagic_proc_dir)
+		goto fail;
+
+	blackmagic_trace_entry = proc_create("trace", S_IRUSR | S_IWUSR, blackmagic_proc_dir, &trace_proc_fops);
+	if (!blackmagic_trace_entry)
+		goto fail;
+
+	return 0;
+
+fail:
+	blackmagic_trace_exit();
+	return -ENOMEM;
+}
+
+void blackmagic_trace_exit(void)
+{
+	int cpu;
+
+	if (blackmagic_trace_entry)
+	{
+		remove_proc_entry("trace", blackmagic_proc_dir);
+		blackmagic_trace_entry = NULL;
+	}
+
+	if (blackmagic_proc_dir)
+	{
+		remove_proc_entry("driver/blackmagic", NULL);
+		blackmagic_proc_dir = NULL;
+	}
+
+	for_each_possible_cpu(cpu)
+	{
+		kfree(per_cpu(blackmagic_trace_buffers, cpu));
+		per_cpu(blackmagic_trace_buffers, cpu) = NULL;
+	}
+}
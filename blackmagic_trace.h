@@ -0,0 +1,81 @@
+/* -LICENSE-START-
+** Copyright (c) 2013 Blackmagic Design
+**
+** Permission is hereby granted, free of charge, to any person or organization
+** obtaining a copy of the software and accompanying documentation covered by
+** this license (the "Software") to use, reproduce, display, distribute,
+** execute, and transmit the Software, and to prepare derivative works of the
+** Software, and to permit third-parties to whom the Software is furnished to
+** do so, all subject to the following:
+**
+** The copyright notices in the Software and this entire statement, including
+** the above license grant, this restriction and the following disclaimer,
+** must be included in all copies of the Software, in whole or in part, and
+** all derivative works of the Software, unless such copies or derivative
+** works are solely in the form of machine-executable object code generated by
+** a source language processor.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+** SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+** FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+** ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+** DEALINGS IN THE SOFTWARE.
+** -LICENSE-END-
+*/
+
+
+#ifndef BLACKMAGIC_TRACE_H
+#define BLACKMAGIC_TRACE_H
+
+/*
+ * Flight recorder: a fixed-size ring of binary records per CPU holding the
+ * most recent interrupt, bottom half, gate and DMA activity. Dumped and
+ * controlled through /proc/driver/blackmagic/trace; recording pauses while
+ * that file is open.
+ */
+
+enum blackmagic_trace_type
+{
+	BLACKMAGIC_TRACE_NONE = 0,
+	BLACKMAGIC_TRACE_ISR,					/* arg: interrupt handler status, data: card id */
+	BLACKMAGIC_TRACE_TASKLET,				/* arg: tasklet handler status, data: card id */
+	BLACKMAGIC_TRACE_WORK,					/* data: card id */
+	BLACKMAGIC_TRACE_GATE_LOCK,				/* arg: pid, data: gate */
+	BLACKMAGIC_TRACE_GATE_LOCK_INTERRUPT,	/* arg: 1 if taken, 0 if deferred, data: gate */
+	BLACKMAGIC_TRACE_GATE_UNLOCK,			/* arg: pid, data: gate */
+	BLACKMAGIC_TRACE_GATE_HANDOFF,			/* arg: pid of the new owner, data: gate */
+	BLACKMAGIC_TRACE_DMA_MAP,				/* arg: pages or bytes mapped, data: dma list */
+	BLACKMAGIC_TRACE_DMA_UNMAP,				/* arg: pages or bytes unmapped, data: dma list */
+	BLACKMAGIC_TRACE_FREEZE,				/* arg: pid */
+	BLACKMAGIC_TRACE_MAX
+};
+
+struct blackmagic_trace_record
+{
+	unsigned long long	timestamp;		/* dl_uptime() */
+	unsigned long long	data;
+	unsigned int		arg;
+	unsigned short		type;
+	unsigned short		context;		/* hard irq / softirq / task */
+};
+
+extern bool blackmagic_trace_enable;
+extern atomic_t blackmagic_trace_frozen;	/* Non-zero while recording is stopped */
+
+void __blackmagic_trace(unsigned int type, unsigned int arg, unsigned long long data);
+
+static inline void blackmagic_trace(unsigned int type, unsigned int arg, unsigned long long data)
+{
+	if (likely(blackmagic_trace_enable) && likely(!atomic_read(&blackmagic_trace_frozen)))
+		__blackmagic_trace(type, arg, data);
+}
+
+/* /proc/driver/blackmagic, created by blackmagic_trace_init */
+extern struct proc_dir_entry *blackmagic_proc_dir;
+
+int blackmagic_trace_init(void);
+void blackmagic_trace_exit(void);
+
+#endif